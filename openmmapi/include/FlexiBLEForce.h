@@ -255,6 +255,142 @@ namespace FlexiBLE
             return CutoffMethod;
         }
 
+        /*Order in which the denominator tree is walked: 0 for depth first, 1 for
+        breadth first. Both visit the same terms, depth first keeps fewer pending
+        nodes in memory.*/
+        void SetEnumerationOrder(int InputOrder)
+        {
+            if (IfSetEnumerationOrder == 0)
+            {
+                if (InputOrder != 0 && InputOrder != 1)
+                    throw OpenMM::OpenMMException("FlexiBLE: Unknown enumeration order");
+                EnumerationOrder = InputOrder;
+                IfSetEnumerationOrder = 1;
+            }
+        }
+
+        int GetEnumerationOrder() const
+        {
+            return EnumerationOrder;
+        }
+
+        /*When set to 1, every arrangement in the denominator is generated from
+        exactly one parent (the one undoing its leftmost swap), so no table of
+        visited arrangements is kept and no arrangement is scored twice. The
+        terms summed are the same as with 0, the default.*/
+        void SetCanonicalParents(int InputCanonical)
+        {
+            if (IfSetCanonicalParents == 0)
+            {
+                CanonicalParents = InputCanonical;
+                IfSetCanonicalParents = 1;
+            }
+        }
+
+        int GetCanonicalParents() const
+        {
+            return CanonicalParents;
+        }
+
+        /*When set to 1, each threshold iteration of the denominator starts from
+        the arrangements accepted and rejected by the previous one and only
+        expands what passes the lowered threshold, instead of walking the tree
+        again from the start. The walk is then serial and keeps a table of
+        visited arrangements, whatever SetNumThreads and SetCanonicalParents
+        ask for.*/
+        void SetWarmStart(int InputWarmStart)
+        {
+            if (IfSetWarmStart == 0)
+            {
+                WarmStart = InputWarmStart;
+                IfSetWarmStart = 1;
+            }
+        }
+
+        int GetWarmStart() const
+        {
+            return WarmStart;
+        }
+
+        /*Largest number of nodes the denominator of one molecule group may
+        visit. The force calculation throws once it is exceeded instead of
+        running out of memory. 0 stands for no limit.*/
+        void SetMaxNodes(int InputMaxNodes)
+        {
+            if (IfSetMaxNodes == 0)
+            {
+                MaxNodes = InputMaxNodes;
+                IfSetMaxNodes = 1;
+            }
+        }
+
+        int GetMaxNodes() const
+        {
+            return MaxNodes;
+        }
+
+        /*Largest difference in distance to the boundary center (nm) between
+        two molecules whose pair function is stored. Any arrangement holding
+        a pair further apart counts as zero. 0 picks, for each group, the
+        distance beyond which a single pair already underflows exp(-g) in
+        double precision, which leaves every result unchanged.*/
+        void SetPairCutoff(double InputPairCutoff)
+        {
+            if (IfSetPairCutoff == 0)
+            {
+                if (InputPairCutoff < 0.0)
+                    throw OpenMM::OpenMMException("FlexiBLE: The pair cutoff cannot be negative");
+                PairCutoff = InputPairCutoff;
+                IfSetPairCutoff = 1;
+            }
+        }
+
+        double GetPairCutoff() const
+        {
+            return PairCutoff;
+        }
+
+        /*Interpolate the pair function from a table built for each group's
+        alpha instead of working it out for every pair, to within this
+        tolerance of the analytic form (relative above 1, absolute below).
+        Energies and forces then carry relative errors of the same order.
+        0 keeps the analytic form.*/
+        void SetPairTableTolerance(double InputPairTableTolerance)
+        {
+            if (IfSetPairTableTolerance == 0)
+            {
+                if (InputPairTableTolerance < 0.0)
+                    throw OpenMM::OpenMMException("FlexiBLE: The pair table tolerance cannot be negative");
+                PairTableTolerance = InputPairTableTolerance;
+                IfSetPairTableTolerance = 1;
+            }
+        }
+
+        double GetPairTableTolerance() const
+        {
+            return PairTableTolerance;
+        }
+
+        /*Number of threads enumerating the denominator tree of a molecule
+        group. 1 runs it on the calling thread, 0 uses one thread per core.
+        With more than one thread the terms are summed in a run dependent
+        order, so results only agree to rounding.*/
+        void SetNumThreads(int InputNumThreads)
+        {
+            if (IfSetNumThreads == 0)
+            {
+                if (InputNumThreads < 0)
+                    throw OpenMM::OpenMMException("FlexiBLE: The number of threads cannot be negative");
+                NumThreads = InputNumThreads;
+                IfSetNumThreads = 1;
+            }
+        }
+
+        int GetNumThreads() const
+        {
+            return NumThreads;
+        }
+
         void SetTemperature(double InputT)
         {
             if (IfSetTemperature == 0)
@@ -340,6 +476,20 @@ namespace FlexiBLE
         std::vector<double> Scales;
         int IfSetCutoffMethod = 0;
         int CutoffMethod = 0;
+        int IfSetEnumerationOrder = 0;
+        int EnumerationOrder = 0;
+        int IfSetCanonicalParents = 0;
+        int CanonicalParents = 0;
+        int IfSetWarmStart = 0;
+        int WarmStart = 0;
+        int IfSetMaxNodes = 0;
+        int MaxNodes = 0;
+        int IfSetPairCutoff = 0;
+        double PairCutoff = 0.0;
+        int IfSetPairTableTolerance = 0;
+        double PairTableTolerance = 0.0;
+        int IfSetNumThreads = 0;
+        int NumThreads = 1;
         double Temperature = 300;
         int IfSetTemperature = 0;
         int IfEnableValOutput = 0;
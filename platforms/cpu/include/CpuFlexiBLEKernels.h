@@ -0,0 +1,42 @@
+#ifndef CPU_FLEXIBLE_KERNELS_H_
+#define CPU_FLEXIBLE_KERNELS_H_
+
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/cpu/CpuPlatform.h"
+
+namespace FlexiBLE
+{
+    /**
+     * This kernel is invoked by FlexiBLEForce to calculate the forces acting on the system on the CPU platform.
+     * It evaluates the same terms as the reference kernel, whose pair loops already pick the widest vector
+     * instructions of the processor, but runs the groups and the denominator enumeration on the thread pool
+     * of the platform, so its Threads property sets how many threads FlexiBLE uses.
+     */
+    class CpuCalcFlexiBLEForceKernel : public ReferenceCalcFlexiBLEForceKernel
+    {
+    public:
+        CpuCalcFlexiBLEForceKernel(std::string name, const OpenMM::Platform &platform, OpenMM::CpuPlatform::PlatformData &data)
+            : ReferenceCalcFlexiBLEForceKernel(name, platform), data(data) {}
+        /**
+         * Initialize the kernel.
+         *
+         * @param system     the System this kernel will be applied to
+         * @param force      the FlexiBLEForce this kernel will be used for
+         */
+        void initialize(const OpenMM::System &system, const FlexiBLEForce &force);
+
+    private:
+        OpenMM::CpuPlatform::PlatformData &data;
+    };
+} // namespace FlexiBLE
+
+#endif /*CPU_FLEXIBLE_KERNELS_H_*/
@@ -0,0 +1,49 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuFlexiBLEKernelFactory.h"
+#include "CpuFlexiBLEKernels.h"
+#include "openmm/cpu/CpuPlatform.h"
+#include "openmm/internal/ContextImpl.h"
+#include "openmm/OpenMMException.h"
+
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" void registerPlatforms() {}
+
+extern "C" void registerKernelFactories()
+{
+    for (int i = 0; i < Platform::getNumPlatforms(); i++)
+    {
+        Platform &platform = Platform::getPlatform(i);
+        if (dynamic_cast<CpuPlatform *>(&platform) != NULL)
+        {
+            CpuFlexiBLEKernelFactory *factory = new CpuFlexiBLEKernelFactory();
+            platform.registerKernelFactory(CalcFlexiBLEForceKernel::Name(), factory);
+        }
+    }
+}
+
+extern "C" void registerFlexiBLECpuKernelFactories()
+{
+    // The CPU platform is a plugin itself, programs that did not load the plugins get it registered here
+    try
+    {
+        Platform::getPlatformByName("CPU");
+    }
+    catch (...)
+    {
+        Platform::registerPlatform(new CpuPlatform());
+    }
+    registerKernelFactories();
+}
+
+KernelImpl *CpuFlexiBLEKernelFactory::createKernelImpl(std::string name, const Platform &platform, ContextImpl &context) const
+{
+    CpuPlatform::PlatformData &data = CpuPlatform::getPlatformData(context);
+    if (name == CalcFlexiBLEForceKernel::Name())
+        return new CpuCalcFlexiBLEForceKernel(name, platform, data);
+    throw OpenMMException((std::string("Tried to create kernel with illegal kernel name '") + name + "'").c_str());
+}
@@ -0,0 +1,21 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "CpuFlexiBLEKernels.h"
+#include "FlexiBLEForce.h"
+
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+void CpuCalcFlexiBLEForceKernel::initialize(const System &system, const FlexiBLEForce &force)
+{
+    // The platform pool replaces any the force asked for, leaving one set of threads for the whole context
+    ReferenceCalcFlexiBLEForceKernel::initialize(system, force);
+    UseThreadPool(data.threads);
+}
@@ -0,0 +1,70 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "FlexiBLETestSystems.h"
+#include <iostream>
+#include <map>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+extern "C" OPENMM_EXPORT void registerFlexiBLECpuKernelFactories();
+
+State evaluate(const string &PlatformName, int NumGroups, int Shape, const vector<vector<double>> &Parameters)
+{
+    System system;
+    vector<Vec3> positions;
+    FlexiBLEForce *boundary = new FlexiBLEForce();
+    buildSystem(system, positions, *boundary, NumGroups, Shape, Parameters);
+    system.addForce(boundary);
+    VerletIntegrator integrator(0.001);
+    Platform &platform = Platform::getPlatformByName(PlatformName);
+    map<string, string> properties;
+    if (PlatformName == "CPU")
+        properties["Threads"] = "4";
+    Context context(system, integrator, platform, properties);
+    context.setPositions(positions);
+    return context.getState(State::Forces | State::Energy);
+}
+
+// The CPU kernel gives the reference forces, up to the order in which the threads add the denominator terms
+void testAgainstReference(int NumGroups, int Shape, const vector<vector<double>> &Parameters)
+{
+    const State expected = evaluate("Reference", NumGroups, Shape, Parameters);
+    const State found = evaluate("CPU", NumGroups, Shape, Parameters);
+    ASSERT_EQUAL_TOL(expected.getPotentialEnergy(), found.getPotentialEnergy(), 1e-10);
+    const vector<Vec3> &expectedForces = expected.getForces(), &foundForces = found.getForces();
+    ASSERT_EQUAL(expectedForces.size(), foundForces.size());
+    for (int a = 0; a < expectedForces.size(); a++)
+        ASSERT_EQUAL_VEC(expectedForces[a], foundForces[a], 1e-10);
+    cout << "CPU forces match the reference for " << NumGroups << " group(s) in boundary shape " << Shape << endl;
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        registerFlexiBLECpuKernelFactories();
+        testAgainstReference(1, 0, {{0.0, 0.0, 0.0}});
+        testAgainstReference(2, 0, {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}});
+        testAgainstReference(1, 2, {{0.0, 0.0, 0.4}});
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef REFERENCE_FLEXIBLE_BOUNDARY_H_
+#define REFERENCE_FLEXIBLE_BOUNDARY_H_
+
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "openmm/Vec3.h"
+#include <algorithm>
+#include <cmath>
+
+namespace FlexiBLE
+{
+    /**
+     * The boundary shapes, one type each, all built from the center of mass of the system and the boundary
+     * parameters of a group. Measure() gives the distance R of a point from the center of the boundary and the
+     * vector Vec pointing to the point from its closest point of that center, so Vec / R is the derivative of R
+     * over the position. The distance loops are instantiated per shape, leaving no shape test inside of them.
+     */
+    namespace BoundaryShapes
+    {
+        struct Sphere
+        {
+            OpenMM::Vec3 Center;
+
+            explicit Sphere(const OpenMM::Vec3 &Center) : Center(Center) {}
+            void Measure(const OpenMM::Vec3 &p, double &R, OpenMM::Vec3 &Vec) const
+            {
+                Vec = p - Center;
+                R = std::sqrt(Vec.dot(Vec));
+            }
+        };
+
+        // Shape 0, a sphere around the center of mass
+        struct COMSphere : Sphere
+        {
+            COMSphere(const OpenMM::Vec3 &COM, const double *Parameters) : Sphere(COM) {}
+        };
+
+        // Shape 1, a sphere around a given point
+        struct FixedSphere : Sphere
+        {
+            FixedSphere(const OpenMM::Vec3 &COM, const double *Parameters) : Sphere(OpenMM::Vec3(Parameters[0], Parameters[1], Parameters[2])) {}
+        };
+
+        // The points within a distance of the segment from L1 to L2
+        struct Capsule
+        {
+            OpenMM::Vec3 L1, L2, LVec;
+            double LMod;
+
+            Capsule(const OpenMM::Vec3 &L1, const OpenMM::Vec3 &L2, const OpenMM::Vec3 &LVec) : L1(L1), L2(L2), LVec(LVec), LMod(std::sqrt(LVec.dot(LVec))) {}
+            void Measure(const OpenMM::Vec3 &p, double &R, OpenMM::Vec3 &Vec) const
+            {
+                // Length of the projection on the segment, clamped to its ends
+                const double lMod = (p - L1).dot(LVec) / LMod;
+                const double s = std::min(std::max(lMod / LMod, 0.0), 1.0);
+                Vec = p - (lMod >= LMod ? L2 : L1 + LVec * s);
+                R = std::sqrt(Vec.dot(Vec));
+            }
+        };
+
+        // Shape 2, a capsule along a given vector, centered at the center of mass
+        struct COMCapsule : Capsule
+        {
+            COMCapsule(const OpenMM::Vec3 &COM, const double *Parameters)
+                : Capsule(COM - OpenMM::Vec3(Parameters[0], Parameters[1], Parameters[2]) * 0.5,
+                          COM + OpenMM::Vec3(Parameters[0], Parameters[1], Parameters[2]) * 0.5,
+                          OpenMM::Vec3(Parameters[0], Parameters[1], Parameters[2])) {}
+        };
+
+        // Shape 3, a capsule between two given points
+        struct FixedCapsule : Capsule
+        {
+            FixedCapsule(const OpenMM::Vec3 &COM, const double *Parameters)
+                : Capsule(OpenMM::Vec3(Parameters[0], Parameters[1], Parameters[2]),
+                          OpenMM::Vec3(Parameters[3], Parameters[4], Parameters[5]),
+                          OpenMM::Vec3(Parameters[3] - Parameters[0], Parameters[4] - Parameters[1], Parameters[5] - Parameters[2])) {}
+        };
+    } // namespace BoundaryShapes
+} // namespace FlexiBLE
+
+#endif /*REFERENCE_FLEXIBLE_BOUNDARY_H_*/
@@ -11,13 +11,22 @@
  * -------------------------------------------------------------------------- */
 
 #include "FlexiBLEKernels.h"
+#include "ReferenceFlexiBLENodes.h"
+#include "ReferenceFlexiBLEBoundary.h"
+#include "ReferenceFlexiBLEPairKernel.h"
 #include "openmm/Platform.h"
+#include "openmm/internal/ThreadPool.h"
+#include <atomic>
+#include <condition_variable>
+#include <exception>
 #include <vector>
 #include <array>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <bitset>
-#include <unordered_set>
 #include <string>
+#include <limits>
 
 namespace FlexiBLE
 {
@@ -64,6 +73,12 @@ namespace FlexiBLE
          * @return the potential energy due to the force
          */
         double execute(OpenMM::ContextImpl &context, bool includeForces, bool includeEnergy);
+        /**
+         * Evaluate every group at the given positions, adding the forces to Force.
+         *
+         * @return the potential energy due to the force
+         */
+        double CalcForces(const std::vector<OpenMM::Vec3> &Positions, std::vector<OpenMM::Vec3> &Force);
         /**
          * Copy changed parameters over to a context.
          *
@@ -71,43 +86,168 @@ namespace FlexiBLE
          * @param force      the FlexiBLEForce to copy the parameters from
          */
         void copyParametersToContext(OpenMM::ContextImpl &context, const FlexiBLEForce &force);
+        // Run the groups and denominators on a pool of the platform, in place of the one the force asked for.
+        // Called after initialize(), which sets up the kernel's own pool again.
+        void UseThreadPool(OpenMM::ThreadPool &Threads);
 
-        std::vector<double> Calc_VecMinus(std::vector<double> lhs, std::vector<double> rhs);
-        double Calc_VecDot(std::vector<double> lhs, std::vector<double> rhs);
-        double Calc_VecMod(std::vector<double> lhs);
-        std::vector<double> Calc_VecSum(std::vector<double> lhs, std::vector<double> rhs);
-        std::vector<double> Calc_COM(std::vector<OpenMM::Vec3> Coordinates, int QMFlag, int group, int index);
-        // Calculate the distance between atom and the boundary center
-        void Calc_r(std::vector<std::pair<int, double>> &rCA, std::vector<std::vector<double>> &rCA_Vec, std::vector<OpenMM::Vec3> Coordinates, int iGroup, int TargetAtom, std::vector<std::vector<double>> &drCA);
+        // Atoms of one molecule, borrowed from the topology of its group. Weights are the atom masses over the
+        // mass of the molecule, the derivatives of its COM over the atom positions.
+        struct MoleculeView
+        {
+            const int *Indices;
+            const double *Masses;
+            const double *Weights;
+            double InvMass;
+            int Size;
+        };
+
+        OpenMM::Vec3 Calc_COM(const std::vector<OpenMM::Vec3> &Coordinates, const MoleculeView &Molecule);
+        // Center of mass of every QM and MM molecule, the center of the boundary shapes 0 and 2
+        void Calc_SystemCOM(const std::vector<OpenMM::Vec3> &Coordinates);
+        // Calculate the distance between atom and the boundary center, for the boundary shapes 0 and 2 the COM of
+        // this step has to be calculated first. The outputs are resized and refilled, so buffers kept between
+        // calls are not reallocated.
+        void Calc_r(std::vector<std::pair<int, double>> &rCA, std::vector<OpenMM::Vec3> &rCA_Vec, const std::vector<OpenMM::Vec3> &Coordinates, int iGroup, int TargetAtom);
+        // Choose the atom the boundary pulls in every group, the assigned one or else the atom of the first
+        // molecule that is heaviest and closest to its centroid in the reference geometry. execute() calls it
+        // with the positions of its first step unless it was called before.
+        void SelectDraggedAtoms(const std::vector<OpenMM::Vec3> &Reference);
+        const std::vector<int> &GetDraggedAtoms() const
+        {
+            return DraggedAtoms;
+        }
         // Calculate the derivative of r over coordinates
-        void Calc_dr(int iGroup, int AtomDragged, std::vector<std::pair<int, double>> rCA, std::vector<std::vector<double>> rCA_Vec, std::vector<std::vector<double>> &drCA);
+        void Calc_dr(int iGroup, int AtomDragged, const std::vector<std::pair<int, double>> &rCA, const std::vector<OpenMM::Vec3> &rCA_Vec, std::vector<OpenMM::Vec3> &drCA);
         // This function is here to test the reordering part with function "execute".
-        void TestReordering(int Switch, int GroupIndex, int DragIndex, std::vector<OpenMM::Vec3> coor, std::vector<std::pair<int, double>> rAtom, std::vector<double> COM);
+        void TestReordering(int Switch, int GroupIndex, int DragIndex, const std::vector<OpenMM::Vec3> &coor, const std::vector<std::pair<int, double>> &rAtom, const OpenMM::Vec3 &COM);
 
-        void TestPairFunc(int EnableTestOutput, std::vector<std::vector<gInfo>> gExpPart);
+        // Write the pair function of every pair of molecules, computed from the distances as none is stored densely
+        void TestPairFunc(int EnableTestOutput, double alpha, const std::vector<std::pair<int, double>> &rC_Atom_re);
 
         void TestVal(double Nume, double Deno);
 
         // Calculates the exponential part, and the derivative over Rij(R)
         double CalcPairExpPart(double alpha, double R, double &der);
 
+        /**
+         * Pair function of the molecules of a group in rank order, keeping only the pairs closer than a cutoff,
+         * with cumulative sums over contiguous ranks so the h^QM / h^MM values and the exponents of
+         * arrangements are range queries instead of loops over the pairs.
+         */
+        class PairBand;
+        // Largest distance difference whose pair function does not underflow exp(-g) on its own
+        static double UnderflowCutoff(double alpha);
+        // Important molecules of a threshold iteration: the QM ranks from ImpQMlb and the MM ranks up to ImpMMub,
+        // counted back from the interface until the first one with an h value below h. With none below it, the
+        // window reaches the first QM or the last MM rank.
+        static void ImportantWindow(const std::vector<double> &hList, int QMSize, double h, int &ImpQMlb, int &ImpMMub);
+
         // Calculate the penalty function based on given arrangement, and also the derivative over Ri or Rj
-        double CalcPenalFunc(std::vector<int> seq, int QMSize, std::vector<std::vector<FlexiBLE::gInfo>> g, std::vector<double> &DerList, std::vector<std::pair<int, double>> rC_Atom, double h, int part);
+        double CalcPenalFunc(const std::vector<int> &seq, int QMSize, const std::vector<std::vector<FlexiBLE::gInfo>> &g, std::vector<double> &DerList, const std::vector<std::pair<int, double>> &rC_Atom, double h, int part);
+        // Same from a band covering every molecule of seq, summed over runs of ranks instead of over pairs
+        double CalcPenalFunc(const std::vector<int> &seq, int QMSize, const PairBand &Band, std::vector<double> &DerList, const std::vector<std::pair<int, double>> &rC_Atom, double h, int part, int iGroup = 0);
 
-        // Find the child node based on the given parent node
-        void ProdChild(std::unordered_set<std::string> &Nodes, std::string InputNode, double h, int QMSize, int LB, std::vector<std::vector<FlexiBLE::gInfo>> g, std::vector<double> &DerList, std::vector<std::pair<int, double>> rC_Atom, double &Energy);
+        /**
+         * Everything the denominator enumeration of one molecule group works on. Every group owns an instance in
+         * its step scratch, reset for each denominator evaluation, the enumeration only ever takes it by
+         * reference and its buffers keep their capacity between evaluations.
+         */
+        class DenominatorContext;
 
-        int FindRepeat(std::unordered_set<std::string> Nodes, std::string InputNode);
+        /**
+         * Node evaluation for the denominator. NodeDer[k] holds the sum of the pair function derivatives between
+         * position k of the node and every molecule of the other kind that pairs with it, so the node contributes
+         * -NodeDer[k] * value (QM) or NodeDer[k] * value (MM) to the derivative list. The contributions are
+         * summed by position in the window and only added to the derivatives of the layer once a walk is over.
+         */
+        // Evaluate a node from scratch, returns the exponent of its penalty function
+        double CalcNodeFull(const DenominatorContext &ctx, const uint64_t *Node, double *NodeDer);
+        // Exponent of the child produced by swapping the '1','0' pair at (i, i + 1), derived from its parent
+        double CalcSwapExp(const DenominatorContext &ctx, const uint64_t *Parent, int i, double ParentExp);
+        // NodeDer of the same child, derived from the parent's one by only touching terms of the two swapped molecules
+        void CalcSwapDer(const DenominatorContext &ctx, const uint64_t *Parent, int i, const double *ParentDer, double *ChildDer);
+        void AddNodeDer(const DenominatorContext &ctx, const uint64_t *Node, const double *NodeDer, double NodeVal, double *WinDer);
 
-        void TestNumeDeno(int EnableValOutput, double Nume, std::vector<double> h_list, double alpha, double h, double scale, int QMSize, int MMSize, std::vector<double> NumeForce, std::vector<double> DenoForce, double DenoNow, double DenoLast, std::vector<OpenMM::Vec3> Forces);
+        // Mark a node as visited, throws if that takes the enumeration over MaxNodes
+        template <int NWords>
+        void InsertNode(DenominatorContext &ctx, const uint64_t *Node);
+        // Mark a node above the threshold as visited and queue it, returns its slot for the caller to fill NodeDer
+        template <int NWords>
+        size_t AcceptNode(DenominatorContext &ctx, const uint64_t *Node, double NodeExp);
+        // Mark a child below the threshold as visited, and add it to the sums when CutoffMethod is 1
+        template <int NWords>
+        void KeepFrontier(DenominatorContext &ctx, const uint64_t *Node, const double *NodeDer, double NodeExp);
+        /**
+         * With canonical parents a node P only expands the children made by swapping at i <= k + 1, k being
+         * the position of P's leftmost '0','1' pair, which gives every node exactly one parent. A child below
+         * the threshold can still have several accepted parents, so with CutoffMethod 1 it is only kept by the
+         * one swapping furthest left: the parent made at i checks that no parent made at k < i passes.
+         */
+        bool IsFrontierOwner(const DenominatorContext &ctx, const uint64_t *Child, int i, double ChildExp);
+        // Expand the pending (already accepted) nodes until none is left, adding every node and its kept
+        // children to the denominator
+        template <int NWords>
+        void ProdChild(DenominatorContext &ctx);
+
+        /**
+         * Parallel version of ProdChild, run by every thread of the pool. Each thread expands nodes from its
+         * own work list and steals from the others once that is empty. Node values and derivatives are
+         * accumulated per thread and summed afterwards in thread order. It is not used while the groups
+         * themselves run in parallel.
+         */
+        class DenominatorWorker;
+        template <int NWords>
+        void ProdChildParallel(DenominatorContext &ctx, int ThreadIndex);
+        // Move the next node to expand into the worker's current node, returns false once the tree is exhausted
+        bool PopParallel(DenominatorContext &ctx, int ThreadIndex, double &NodeExp);
+        // Wake threads waiting in PopParallel, one after a push or all when the walk ends
+        static void WakeIdle(DenominatorContext &ctx, bool All);
+
+        // Sum the denominator over the arrangements of the important molecules, starting from the perfect one.
+        // The pairs come from a dense table by original index, or from a band covering the window in the ranks
+        // of rC_Atom. iGroup picks the group whose scratch the evaluation runs in.
+        double CalcDenominator(int NodeSize, double h, int QMSize, int LB, const std::vector<std::vector<FlexiBLE::gInfo>> &g, std::vector<double> &DerList, const std::vector<std::pair<int, double>> &rC_Atom);
+        double CalcDenominator(int NodeSize, double h, int QMSize, int LB, const PairBand &Band, std::vector<double> &DerList, const std::vector<std::pair<int, double>> &rC_Atom, int iGroup = 0);
+        template <int NWords>
+        double CalcDenominator(DenominatorContext &ctx, int QMSize);
+        /**
+         * Same sum for the next threshold iteration of a group. The accepted nodes and the rejected children of
+         * the previous call are kept: they are moved into the grown window, the rejected ones that now pass are
+         * expanded, and so are the children made with the molecules new to the window. Restart (or anything
+         * but a lower threshold on a grown window) starts from the perfect node again.
+         */
+        double CalcDenominatorWarm(int NodeSize, double h, int QMSize, int LB, const std::vector<std::vector<FlexiBLE::gInfo>> &g, std::vector<double> &DerList, const std::vector<std::pair<int, double>> &rC_Atom, bool Restart);
+        double CalcDenominatorWarm(int NodeSize, double h, int QMSize, int LB, const PairBand &Band, std::vector<double> &DerList, const std::vector<std::pair<int, double>> &rC_Atom, bool Restart, int iGroup = 0);
+        template <int NWords>
+        double CalcDenominatorWarm(DenominatorContext &ctx, int QMSize, int LB, bool Restart);
+        // Dispatch a prepared evaluation on the node width of its window
+        double RunDenominator(DenominatorContext &ctx, int QMSize);
+        double RunDenominatorWarm(DenominatorContext &ctx, int QMSize, int LB, bool Restart);
+        // Band is used if given, otherwise a band of the window is built from g
+        DenominatorContext &PrepareDenominator(int NodeSize, double h, int LB, const std::vector<std::vector<FlexiBLE::gInfo>> *g, const PairBand *Band, std::vector<double> &DerList, const std::vector<std::pair<int, double>> &rC_Atom, int iGroup = 0);
+        // Template argument of the node functions for a window size
+        static int NodeWordClass(int NodeSize);
+
+        void TestNumeDeno(int EnableValOutput, double Nume, const std::vector<double> &h_list, double alpha, double h, double scale, int QMSize, int MMSize, const std::vector<double> &NumeForce, const std::vector<double> &DenoForce, double DenoNow, double DenoLast, const std::vector<OpenMM::Vec3> &Forces);
 
     private:
+        class GroupTopology;
+        // The distance loop of one group, instantiated per boundary shape and for molecule COMs or a given atom
+        template <class Shape, bool UseCOM>
+        void Calc_rGroup(const Shape &Boundary, std::vector<std::pair<int, double>> &rCA, std::vector<OpenMM::Vec3> &rCA_Vec, const std::vector<OpenMM::Vec3> &Coordinates, const GroupTopology &Group, int TargetAtom);
+        template <class Shape>
+        void Calc_rShape(std::vector<std::pair<int, double>> &rCA, std::vector<OpenMM::Vec3> &rCA_Vec, const std::vector<OpenMM::Vec3> &Coordinates, int iGroup, int TargetAtom);
+
         class InternalInfo;
         std::vector<std::vector<InternalInfo>> QMGroups;
         std::vector<std::vector<InternalInfo>> MMGroups;
+        // The same molecules stored flat, which the geometry reads through views
+        std::vector<GroupTopology> Topology;
         std::vector<int> AssignedAtomIndex;
+        // The atom each group is pulled by, -1 for the COM, empty until selected
+        std::vector<int> DraggedAtoms;
         std::vector<double> Coefficients;
-        std::vector<double> COM;
+        OpenMM::Vec3 COM;
         int BoundaryShape = 0;
         std::vector<std::vector<double>> BoundaryParameters;
         int EnableTestOutput = 0;
@@ -117,8 +257,29 @@ namespace FlexiBLE
         std::vector<int> FlexiBLEMaxIt;
         std::vector<double> IterScales;
         int CutoffMethod = 0;
+        int EnumerationOrder = 0;
+        int CanonicalParents = 0;
+        int WarmStart = 0;
+        int MaxNodes = 0;
         double T = 300;
+        // Mass of every QM and MM molecule, fixed at initialize()
         double SystemTotalMass = 0.0;
+        // Buffers of execute() for every group, kept from step to step
+        class StepScratch;
+        std::vector<std::unique_ptr<StepScratch>> Scratch;
+        StepScratch &GetScratch(int iGroup = 0);
+        // Distances, pairs, numerator and denominator of one group, leaving its forces in its scratch
+        double ExecuteGroup(int iGroup, const std::vector<OpenMM::Vec3> &Positions, StepScratch &S);
+        // Set while the groups are evaluated on the pool, which then leaves every denominator to one thread
+        bool GroupsInParallel = false;
+        double PairCutoff = 0.0;
+        // One interpolation table per group, none when the pair function is worked out
+        std::vector<PairTable> PairTables;
+        PairKernel::Isa PairIsa = PairKernel::Scalar;
+        int NumThreads = 1;
+        // The pool the groups and denominators run on, owned by the kernel unless a platform lends it one
+        OpenMM::ThreadPool *Pool = nullptr;
+        std::unique_ptr<OpenMM::ThreadPool> OwnedPool;
         // double time_total = 0.0;
         // double find_replica = 0.0;
         // double produce_nodes = 0.0;
@@ -131,6 +292,306 @@ namespace FlexiBLE
         std::vector<int> Indices;
         std::vector<double> AtomMasses;
     };
+    class ReferenceCalcFlexiBLEForceKernel::GroupTopology
+    {
+    public:
+        // The atoms of every molecule of a group back to back, QM molecules first. Molecule j owns the entries
+        // Start[j] to Start[j + 1] - 1 of Atoms, Masses, Weights and SystemWeights. Weights divide the masses
+        // by the mass of their molecule and SystemWeights by the mass of all groups, both fixed at initialize.
+        int QMSize = 0;
+        std::vector<int> Start;
+        std::vector<int> Atoms;
+        std::vector<double> Masses;
+        std::vector<double> Weights;
+        std::vector<double> SystemWeights;
+        std::vector<double> InvMasses;
+
+        int NumMolecules() const
+        {
+            return (int)Start.size() - 1;
+        }
+        MoleculeView Molecule(int j) const
+        {
+            return {Atoms.data() + Start[j], Masses.data() + Start[j], Weights.data() + Start[j], InvMasses[j], Start[j + 1] - Start[j]};
+        }
+    };
+    class ReferenceCalcFlexiBLEForceKernel::PairBand
+    {
+    public:
+        /**
+         * Only a molecule ranked further out than its partner pairs with it, so row a holds the pairs with the
+         * ranks Lo[a] <= c < a. Pairs further apart than the cutoff are not stored: their exponential part is
+         * taken as infinite, which makes the penalty function of any arrangement holding one of them zero, and
+         * they add nothing to the derivatives.
+         *
+         * The cumulative sums of row a run over the ranks below a and the ones of column b over the ranks
+         * above b (up to Hi[b], the first rank whose row no longer reaches b). Both start next to the diagonal:
+         * the near pairs are the small ones, so a range never takes the difference of two large partial sums.
+         *
+         * Everything is stored row after row in rank order, values and derivatives in separate planes, so
+         * filling a row, summing it and walking a node all stream through memory.
+         */
+        // Cover ranks Begin to Begin + Count - 1 of rC_Atom, dropping pairs further apart than Cutoff (none if
+        // Cutoff <= 0). The caller then fills every row of PairVal and PairDer and calls Accumulate().
+        void Layout(const std::vector<std::pair<int, double>> &rC_Atom, int Begin, int Count, double Cutoff);
+        void Accumulate();
+        // Layout and fill from a dense table indexed by original index, keeping every pair
+        void Build(const std::vector<std::vector<gInfo>> &g, const std::vector<std::pair<int, double>> &rC_Atom, int Begin, int Count);
+        /**
+         * Ranks of a layer whose molecules can pair with a molecule on the other side of the QM/MM interface
+         * (between ranks QMSize - 1 and QMSize) without the pair being beyond Cutoff. A molecule outside of
+         * them pairs beyond the cutoff with the interface molecule on the other side, so its h^QM or h^MM is
+         * zero, and it is on the wrong side in an arrangement only if the penalty function is zero.
+         */
+        static void InterfaceSpan(const std::vector<std::pair<int, double>> &rC_Atom, int QMSize, double Cutoff, int &Begin, int &Count);
+
+        // Position of the pair at ranks (a, c) in PairVal and PairDer, for Lo[a] <= c < a
+        size_t Index(int a, int c) const
+        {
+            return Start[a] + (c - Lo[a]);
+        }
+        // Derivative of the pair at ranks (a, c), zero if a is not further out or the pair is not stored
+        double Der(int a, int c) const
+        {
+            if (c >= a || c < Lo[a])
+                return 0.0;
+            return PairDer[Index(a, c)];
+        }
+        /**
+         * Pair of the molecules with original indices i and j, both covered by the band. Only the direction with
+         * i further out than j can be nonzero and only that one is stored, so the other gives zero, and a pair
+         * beyond the cutoff has an infinite value and no derivative.
+         */
+        gInfo Get(int i, int j) const
+        {
+            const int a = Rank[i], c = Rank[j];
+            gInfo pair = {0.0, 0.0};
+            if (c < a)
+            {
+                if (c >= Lo[a])
+                {
+                    pair.val = PairVal[Index(a, c)];
+                    pair.der = PairDer[Index(a, c)];
+                }
+                else
+                    pair.val = std::numeric_limits<double>::infinity();
+            }
+            return pair;
+        }
+        // Sums of the pairs between the molecule at rank a and the ones at ranks lo <= c < hi inside of it
+        double RowVal(int a, int lo, int hi) const
+        {
+            if (hi > a)
+                hi = a;
+            if (lo >= hi)
+                return 0.0;
+            if (lo < Lo[a])
+                return std::numeric_limits<double>::infinity();
+            return RowValSum[RowStart[a] + (lo - Lo[a])] - RowValSum[RowStart[a] + (hi - Lo[a])];
+        }
+        double RowDer(int a, int lo, int hi) const
+        {
+            if (hi > a)
+                hi = a;
+            if (lo < Lo[a])
+                lo = Lo[a];
+            if (lo >= hi)
+                return 0.0;
+            return RowDerSum[RowStart[a] + (lo - Lo[a])] - RowDerSum[RowStart[a] + (hi - Lo[a])];
+        }
+        // Sums of the pairs between the molecule at rank b and the ones at ranks lo <= c < hi outside of it
+        double ColVal(int b, int lo, int hi) const
+        {
+            if (lo <= b)
+                lo = b + 1;
+            if (lo >= hi)
+                return 0.0;
+            if (hi > Hi[b])
+                return std::numeric_limits<double>::infinity();
+            return ColValSum[ColStart[b] + (hi - b - 1)] - ColValSum[ColStart[b] + (lo - b - 1)];
+        }
+        double ColDer(int b, int lo, int hi) const
+        {
+            if (lo <= b)
+                lo = b + 1;
+            if (hi > Hi[b])
+                hi = Hi[b];
+            if (lo >= hi)
+                return 0.0;
+            return ColDerSum[ColStart[b] + (hi - b - 1)] - ColDerSum[ColStart[b] + (lo - b - 1)];
+        }
+
+        // Ranks First to First + Size - 1 of rC_Atom are covered, indices above are relative to First
+        int First = 0;
+        int Size = 0;
+        // Bumped by every Layout, so a warm start can tell a refilled band from the one it was built on
+        unsigned long long Version = 0;
+        // Original index of the molecule at each rank, and the rank of each original index (below 0 or from Size
+        // on if it is not covered)
+        std::vector<int> Order, Rank;
+        // Distance of the molecule at each rank from the boundary center
+        std::vector<double> R;
+        std::vector<int> Lo, Hi;
+        // Offsets of each row of the pairs, of each row sum and of each column sum
+        std::vector<size_t> Start, RowStart, ColStart;
+        std::vector<double> PairVal, PairDer;
+        std::vector<double> RowValSum, RowDerSum, ColValSum, ColDerSum;
+    };
+    class ReferenceCalcFlexiBLEForceKernel::DenominatorWorker
+    {
+    public:
+        // Guards Work, other threads steal from its front
+        std::mutex Lock;
+        NodeWorkList Work;
+        std::vector<uint64_t> Node, Child;
+        std::vector<double> NodeDer, ChildDer;
+        // Denominator and derivative sums of the nodes this thread expanded, by position in the node
+        double Deno = 0.0;
+        std::vector<double> WinDer;
+    };
+    class ReferenceCalcFlexiBLEForceKernel::DenominatorContext
+    {
+    public:
+        std::vector<double> *DerList = nullptr;
+        // Derivative sums of the nodes by position in the window, and where the walk adds its nodes to: WinDer
+        // for a cold evaluation and AccDer for a warm one
+        std::vector<double> WinDer;
+        double *NodeSums = nullptr;
+        // Pairs the nodes are scored from, position k of the node is rank BandBase + k of the band
+        const PairBand *Band = nullptr;
+        int BandBase = 0;
+        PairBand LocalBand;
+        // What the pairs were taken from, the dense table or the band at a given version
+        const void *Source = nullptr;
+        unsigned long long SourceVersion = 0;
+        // Original index of the molecule at each position of the node
+        std::vector<int> WinIdx;
+        int NodeSize = 0;
+        int Words = 1;
+        double h = 0.0;
+        double Deno = 0.0;
+        // Nodes still to be expanded, and the node being expanded with its NodeDer
+        NodeWorkList Work;
+        std::vector<uint64_t> Node;
+        std::vector<double> NodeDer;
+        // Scratch for a child that is scored but not expanded
+        std::vector<uint64_t> Child;
+        std::vector<double> ChildDer;
+        NodeTable<1> Nodes1;
+        NodeTable<2> Nodes2;
+        NodeTable<0> NodesN;
+
+        // Kept from one threshold iteration to the next when warm starting. Accepted and Frontier hold nodes
+        // back to back, sums over the accepted nodes and over the frontier are kept apart, since only
+        // CutoffMethod 1 counts the frontier and its nodes may be accepted later.
+        bool Warm = false;
+        bool WarmValid = false;
+        const void *WarmSource = nullptr;
+        unsigned long long WarmVersion = 0;
+        double WarmH = 0.0;
+        int WarmLB = 0;
+        int WarmNodeSize = 0;
+        int WarmWords = 1;
+        std::vector<uint64_t> Accepted, Frontier, Remapped;
+        std::vector<double> FrontierExp;
+        double AccDeno = 0.0, FrontDeno = 0.0;
+        // By position in the window, they move up with it when it grows
+        std::vector<double> AccDer, FrontDer;
+
+        // State of the parallel enumeration
+        std::vector<std::unique_ptr<DenominatorWorker>> Workers;
+        ShardedNodeTable<1> Shared1;
+        ShardedNodeTable<2> Shared2;
+        ShardedNodeTable<0> SharedN;
+        // Nodes pushed but not expanded yet, the walk is over when it drops to zero
+        std::atomic<long long> Pending;
+        std::atomic<long long> NumVisited;
+        std::atomic<bool> OverBudget;
+        // Nodes sitting in the work lists, and the threads waiting on Idle for one to steal
+        std::atomic<long long> Queued;
+        std::atomic<int> Waiting;
+        std::mutex IdleLock;
+        std::condition_variable Idle;
+
+        template <int NWords>
+        NodeTable<NWords> &Nodes();
+        template <int NWords>
+        ShardedNodeTable<NWords> &SharedNodes();
+    };
+    class ReferenceCalcFlexiBLEForceKernel::StepScratch
+    {
+    public:
+        // Every buffer of a step is refilled in place, so once they have grown to the largest group a step
+        // allocates nothing
+        void Reserve(int NumMolecules, int NumAtoms)
+        {
+            rCenter_Atom.reserve(NumMolecules);
+            rCenter_Atom_re.reserve(NumMolecules);
+            rCenter_Atom_Vec.reserve(NumMolecules);
+            drCenter_Atom_Vec.reserve(NumMolecules * NumAtoms);
+            ForceList.reserve(NumMolecules * NumAtoms);
+            hList_re.reserve(NumMolecules);
+            dDen_dr.reserve(NumMolecules);
+            dNume_dr.reserve(NumMolecules);
+            df_dr.reserve(NumMolecules);
+            DerListDen.reserve(NumMolecules);
+            NumeSeq.reserve(NumMolecules);
+            Kind.reserve(NumMolecules);
+            QMRuns.reserve(NumMolecules);
+            MMRuns.reserve(NumMolecules);
+            GroupForce.reserve(NumMolecules * NumAtoms);
+        }
+
+        // Distances, vectors from the boundary center and their derivatives of the group
+        std::vector<std::pair<int, double>> rCenter_Atom, rCenter_Atom_re;
+        std::vector<OpenMM::Vec3> rCenter_Atom_Vec, drCenter_Atom_Vec;
+        std::vector<OpenMM::Vec3> ForceList;
+        std::vector<double> hList_re, dDen_dr, dNume_dr, df_dr, DerListDen;
+        std::vector<int> NumeSeq;
+        PairBand Pairs;
+        // Kind of molecule at each rank of the band and the runs of them, for the penalty function
+        std::vector<char> Kind;
+        std::vector<std::pair<int, int>> QMRuns, MMRuns;
+        DenominatorContext Denominator;
+        // What the group adds to the forces of its atoms, in the order of its topology, and the force its
+        // boundary puts on the COM. They are added to the context in group order.
+        std::vector<OpenMM::Vec3> GroupForce;
+        OpenMM::Vec3 COMForce;
+        double Energy = 0.0;
+        std::exception_ptr Error;
+        // Set when the group reaches its last threshold iteration, CalcForces() then writes LastCoor.txt
+        bool LastIteration = false;
+    };
+    template <>
+    inline NodeTable<1> &ReferenceCalcFlexiBLEForceKernel::DenominatorContext::Nodes<1>()
+    {
+        return Nodes1;
+    }
+    template <>
+    inline NodeTable<2> &ReferenceCalcFlexiBLEForceKernel::DenominatorContext::Nodes<2>()
+    {
+        return Nodes2;
+    }
+    template <>
+    inline NodeTable<0> &ReferenceCalcFlexiBLEForceKernel::DenominatorContext::Nodes<0>()
+    {
+        return NodesN;
+    }
+    template <>
+    inline ShardedNodeTable<1> &ReferenceCalcFlexiBLEForceKernel::DenominatorContext::SharedNodes<1>()
+    {
+        return Shared1;
+    }
+    template <>
+    inline ShardedNodeTable<2> &ReferenceCalcFlexiBLEForceKernel::DenominatorContext::SharedNodes<2>()
+    {
+        return Shared2;
+    }
+    template <>
+    inline ShardedNodeTable<0> &ReferenceCalcFlexiBLEForceKernel::DenominatorContext::SharedNodes<0>()
+    {
+        return SharedN;
+    }
 } // namespace FlexiBLE
 
 #endif /*REFERENCE_FLEXIBLE_KERNELS_H_*/
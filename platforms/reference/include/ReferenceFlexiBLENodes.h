@@ -0,0 +1,457 @@
+#ifndef REFERENCE_FLEXIBLE_NODES_H_
+#define REFERENCE_FLEXIBLE_NODES_H_
+
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include <cstdint>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+namespace FlexiBLE
+{
+    /**
+     * A node of the denominator tree is one QM/MM arrangement of the important molecules.
+     * It is stored as packed 64-bit words: bit i (word i / 64, bit i % 64) is set when the
+     * molecule at rank LB + i is treated as QM.
+     *
+     * Everything below is templated over NWords. NWords = 1 or 2 fixes the width at compile
+     * time, which covers layers with up to 64 or 128 important molecules; NWords = 0 falls
+     * back to the width given at run time.
+     */
+    template <int NWords>
+    struct NodeWidth
+    {
+        static int Get(int RuntimeWords)
+        {
+            return NWords;
+        }
+    };
+
+    template <>
+    struct NodeWidth<0>
+    {
+        static int Get(int RuntimeWords)
+        {
+            return RuntimeWords;
+        }
+    };
+
+    namespace NodeBits
+    {
+        inline int NumWords(int NodeSize)
+        {
+            return NodeSize > 0 ? (NodeSize + 63) / 64 : 1;
+        }
+
+        inline bool Test(const uint64_t *Node, int i)
+        {
+            return ((Node[i >> 6] >> (i & 63)) & 1) != 0;
+        }
+
+        inline void Set(uint64_t *Node, int i)
+        {
+            Node[i >> 6] |= (uint64_t)1 << (i & 63);
+        }
+
+        inline void Clear(uint64_t *Node, int i)
+        {
+            Node[i >> 6] &= ~((uint64_t)1 << (i & 63));
+        }
+
+        // Turn the adjacent '1','0' pair at (i, i + 1) into '0','1'
+        inline void SwapDown(uint64_t *Node, int i)
+        {
+            Clear(Node, i);
+            Set(Node, i + 1);
+        }
+
+        template <int NWords>
+        inline void Copy(uint64_t *Dst, const uint64_t *Src, int Words)
+        {
+            const int n = NodeWidth<NWords>::Get(Words);
+            for (int w = 0; w < n; w++)
+                Dst[w] = Src[w];
+        }
+
+        template <int NWords>
+        inline bool Equal(const uint64_t *lhs, const uint64_t *rhs, int Words)
+        {
+            const int n = NodeWidth<NWords>::Get(Words);
+            for (int w = 0; w < n; w++)
+            {
+                if (lhs[w] != rhs[w])
+                    return false;
+            }
+            return true;
+        }
+
+        // splitmix64 finalizer, good enough to spread the low bits of sparse words
+        inline uint64_t Mix(uint64_t x)
+        {
+            x ^= x >> 30;
+            x *= 0xbf58476d1ce4e5b9ULL;
+            x ^= x >> 27;
+            x *= 0x94d049bb133111ebULL;
+            x ^= x >> 31;
+            return x;
+        }
+
+        template <int NWords>
+        inline uint64_t Hash(const uint64_t *Node, int Words)
+        {
+            const int n = NodeWidth<NWords>::Get(Words);
+            uint64_t h = 0x9e3779b97f4a7c15ULL;
+            for (int w = 0; w < n; w++)
+                h = Mix(h ^ Node[w]);
+            return h;
+        }
+
+        inline int LowestBit(uint64_t Word)
+        {
+#if defined(_MSC_VER)
+            unsigned long index;
+            _BitScanForward64(&index, Word);
+            return (int)index;
+#else
+            return __builtin_ctzll(Word);
+#endif
+        }
+
+        // First position in [From, End) that is QM (NextSet) or MM (NextClear), End if there is none
+        inline int NextSet(const uint64_t *Node, int From, int End)
+        {
+            for (int w = From >> 6; (w << 6) < End; w++)
+            {
+                uint64_t word = Node[w];
+                if ((w << 6) < From)
+                    word &= ~(uint64_t)0 << (From & 63);
+                if (word != 0)
+                {
+                    const int i = (w << 6) + LowestBit(word);
+                    return i < End ? i : End;
+                }
+            }
+            return End;
+        }
+
+        inline int NextClear(const uint64_t *Node, int From, int End)
+        {
+            for (int w = From >> 6; (w << 6) < End; w++)
+            {
+                uint64_t word = ~Node[w];
+                if ((w << 6) < From)
+                    word &= ~(uint64_t)0 << (From & 63);
+                if (word != 0)
+                {
+                    const int i = (w << 6) + LowestBit(word);
+                    return i < End ? i : End;
+                }
+            }
+            return End;
+        }
+
+        // Position of the leftmost '0','1' pair of the node, NodeSize if there is none
+        inline int FirstRise(const uint64_t *Node, int NodeSize)
+        {
+            for (int k = 0; k < NodeSize - 1; k++)
+            {
+                if (!Test(Node, k) && Test(Node, k + 1))
+                    return k;
+            }
+            return NodeSize;
+        }
+
+        // Place a node of SrcSize positions at Offset in a larger one, the positions before it are QM and the
+        // ones after it MM
+        inline void Embed(uint64_t *Dst, int DstWords, const uint64_t *Src, int SrcSize, int Offset)
+        {
+            for (int w = 0; w < DstWords; w++)
+                Dst[w] = 0;
+            for (int i = 0; i < Offset; i++)
+                Set(Dst, i);
+            for (int i = 0; i < SrcSize; i++)
+            {
+                if (Test(Src, i))
+                    Set(Dst, Offset + i);
+            }
+        }
+
+        // Build the arrangement with every QM molecule inside of every MM molecule
+        inline void MakePerfect(uint64_t *Node, int Words, int nQM)
+        {
+            for (int w = 0; w < Words; w++)
+                Node[w] = 0;
+            for (int i = 0; i < nQM; i++)
+                Set(Node, i);
+        }
+    } // namespace NodeBits
+
+    /**
+     * Open-addressing set of nodes with linear probing. Keys are stored back to back in one
+     * flat array, so looking up or inserting a node does not allocate unless the table grows.
+     */
+    template <int NWords>
+    class NodeTable
+    {
+    public:
+        NodeTable() : Words(NodeWidth<NWords>::Get(1)), Mask(0), Count(0) {}
+
+        // Forget every node and switch to nodes made of the given number of words. The table keeps the size it
+        // has grown to, so refilling it with a similar number of nodes does not allocate.
+        void Reset(int RuntimeWords, size_t Expected = 64)
+        {
+            Words = NodeWidth<NWords>::Get(RuntimeWords);
+            size_t Capacity = Hashes.size() < 16 ? 16 : Hashes.size();
+            while (Capacity < 2 * Expected)
+                Capacity <<= 1;
+            Hashes.assign(Capacity, 0);
+            Keys.assign(Capacity * Words, 0);
+            Mask = Capacity - 1;
+            Count = 0;
+        }
+
+        size_t Size() const
+        {
+            return Count;
+        }
+
+        bool Contains(const uint64_t *Node) const
+        {
+            if (Count == 0)
+                return false;
+            const uint64_t h = Tag(Node);
+            for (size_t slot = h & Mask;; slot = (slot + 1) & Mask)
+            {
+                if (Hashes[slot] == 0)
+                    return false;
+                if (Hashes[slot] == h && NodeBits::Equal<NWords>(&Keys[slot * Words], Node, Words))
+                    return true;
+            }
+        }
+
+        // Returns true if the node was not in the table before
+        bool Insert(const uint64_t *Node)
+        {
+            if (2 * (Count + 1) > Hashes.size())
+                Grow();
+            const uint64_t h = Tag(Node);
+            for (size_t slot = h & Mask;; slot = (slot + 1) & Mask)
+            {
+                if (Hashes[slot] == 0)
+                {
+                    Hashes[slot] = h;
+                    NodeBits::Copy<NWords>(&Keys[slot * Words], Node, Words);
+                    Count++;
+                    return true;
+                }
+                if (Hashes[slot] == h && NodeBits::Equal<NWords>(&Keys[slot * Words], Node, Words))
+                    return false;
+            }
+        }
+
+    private:
+        // A zero hash marks an empty slot, so keep the top bit set on real entries
+        uint64_t Tag(const uint64_t *Node) const
+        {
+            return NodeBits::Hash<NWords>(Node, Words) | ((uint64_t)1 << 63);
+        }
+
+        void Grow()
+        {
+            std::vector<uint64_t> OldHashes, OldKeys;
+            OldHashes.swap(Hashes);
+            OldKeys.swap(Keys);
+            const size_t Capacity = OldHashes.empty() ? 16 : 2 * OldHashes.size();
+            Hashes.assign(Capacity, 0);
+            Keys.assign(Capacity * Words, 0);
+            Mask = Capacity - 1;
+            for (size_t i = 0; i < OldHashes.size(); i++)
+            {
+                if (OldHashes[i] == 0)
+                    continue;
+                size_t slot = OldHashes[i] & Mask;
+                while (Hashes[slot] != 0)
+                    slot = (slot + 1) & Mask;
+                Hashes[slot] = OldHashes[i];
+                NodeBits::Copy<NWords>(&Keys[slot * Words], &OldKeys[i * Words], Words);
+            }
+        }
+
+        int Words;
+        size_t Mask;
+        size_t Count;
+        std::vector<uint64_t> Hashes;
+        std::vector<uint64_t> Keys;
+    };
+
+    /**
+     * Node set shared by the threads of a parallel enumeration. Nodes are spread over independent tables by
+     * their hash, each guarded by its own lock, so threads only wait on each other when they touch the same
+     * shard at the same time.
+     */
+    template <int NWords>
+    class ShardedNodeTable
+    {
+    public:
+        static const int NumShards = 64;
+
+        ShardedNodeTable() : Words(NodeWidth<NWords>::Get(1)), Shards(NumShards), Locks(NumShards) {}
+
+        // Not thread safe, call it before the threads start
+        void Reset(int RuntimeWords)
+        {
+            Words = NodeWidth<NWords>::Get(RuntimeWords);
+            for (int i = 0; i < NumShards; i++)
+                Shards[i].Reset(RuntimeWords, 16);
+        }
+
+        bool Contains(const uint64_t *Node)
+        {
+            const int i = ShardOf(Node);
+            std::lock_guard<std::mutex> lock(Locks[i]);
+            return Shards[i].Contains(Node);
+        }
+
+        // Returns true for exactly one of the threads inserting the same node
+        bool Insert(const uint64_t *Node)
+        {
+            const int i = ShardOf(Node);
+            std::lock_guard<std::mutex> lock(Locks[i]);
+            return Shards[i].Insert(Node);
+        }
+
+    private:
+        // The tables pick slots from the low bits of the same hash, so shards use high ones
+        int ShardOf(const uint64_t *Node) const
+        {
+            return (int)((NodeBits::Hash<NWords>(Node, Words) >> 52) & (NumShards - 1));
+        }
+
+        int Words;
+        std::vector<NodeTable<NWords>> Shards;
+        std::vector<std::mutex> Locks;
+    };
+
+    /**
+     * Nodes waiting to be expanded, each stored with the exponent of its penalty function and its NodeDer.
+     * It is a ring buffer, so it serves as the stack of a depth-first walk as well as the queue of a
+     * breadth-first one, and it keeps its capacity between evaluations.
+     */
+    class NodeWorkList
+    {
+    public:
+        NodeWorkList() : Words(1), NodeSize(0), Mask(0), Head(0), Count(0) {}
+
+        // Drop every pending node and switch to nodes of the given size
+        void Reset(int InputWords, int InputNodeSize)
+        {
+            Head = 0;
+            Count = 0;
+            if (Exps.empty())
+                Exps.resize(16);
+            Words = InputWords;
+            NodeSize = InputNodeSize;
+            Mask = Exps.size() - 1;
+            if (Keys.size() < Exps.size() * Words)
+                Keys.resize(Exps.size() * Words);
+            if (Ders.size() < Exps.size() * NodeSize)
+                Ders.resize(Exps.size() * NodeSize);
+        }
+
+        bool Empty() const
+        {
+            return Count == 0;
+        }
+
+        size_t Size() const
+        {
+            return Count;
+        }
+
+        // Add an entry at the back and return its slot, slots returned before are invalid afterwards
+        size_t Push()
+        {
+            if (Count == Exps.size())
+                Grow();
+            const size_t slot = (Head + Count) & Mask;
+            Count++;
+            return slot;
+        }
+
+        // Remove the entry at the front or at the back, its slot can be read until the next Push
+        size_t PopFront()
+        {
+            const size_t slot = Head;
+            Head = (Head + 1) & Mask;
+            Count--;
+            return slot;
+        }
+
+        size_t PopBack()
+        {
+            Count--;
+            return (Head + Count) & Mask;
+        }
+
+        uint64_t *Key(size_t slot)
+        {
+            return &Keys[slot * Words];
+        }
+
+        double *Der(size_t slot)
+        {
+            return &Ders[slot * NodeSize];
+        }
+
+        double &Exp(size_t slot)
+        {
+            return Exps[slot];
+        }
+
+    private:
+        // Double the capacity and move the pending entries to the start of the buffers, keeping their order
+        void Grow()
+        {
+            const size_t Capacity = 2 * Exps.size();
+            std::vector<uint64_t> NewKeys(Capacity * Words);
+            std::vector<double> NewDers(Capacity * NodeSize);
+            std::vector<double> NewExps(Capacity);
+            for (size_t i = 0; i < Count; i++)
+            {
+                const size_t slot = (Head + i) & Mask;
+                for (int w = 0; w < Words; w++)
+                    NewKeys[i * Words + w] = Keys[slot * Words + w];
+                for (int k = 0; k < NodeSize; k++)
+                    NewDers[i * NodeSize + k] = Ders[slot * NodeSize + k];
+                NewExps[i] = Exps[slot];
+            }
+            Keys.swap(NewKeys);
+            Ders.swap(NewDers);
+            Exps.swap(NewExps);
+            Mask = Capacity - 1;
+            Head = 0;
+        }
+
+        int Words;
+        int NodeSize;
+        size_t Mask;
+        size_t Head;
+        size_t Count;
+        std::vector<uint64_t> Keys;
+        std::vector<double> Ders;
+        std::vector<double> Exps;
+    };
+} // namespace FlexiBLE
+
+#endif /*REFERENCE_FLEXIBLE_NODES_H_*/
@@ -0,0 +1,79 @@
+#ifndef REFERENCE_FLEXIBLE_PAIR_KERNEL_H_
+#define REFERENCE_FLEXIBLE_PAIR_KERNEL_H_
+
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include <vector>
+
+namespace FlexiBLE
+{
+    /**
+     * Batched evaluation of the exponential part of the pair function, (alpha*R)^3/(1+alpha*R) for R > 0 and 0
+     * otherwise, together with its derivative over R. One call fills a whole row of pairs: the molecule at
+     * distance r against the ones at distances rOther[0] to rOther[n - 1], with R = r - rOther[k].
+     *
+     * Values and derivatives are written to the separate rows Val[0 .. n - 1] and Der[0 .. n - 1]. Every
+     * path does the same operations in the same order as CalcPairExpPart, so they agree with it to rounding.
+     */
+    namespace PairKernel
+    {
+        enum Isa
+        {
+            Scalar = 0,
+            SSE2 = 1,
+            AVX2 = 2,
+            AVX512 = 3
+        };
+
+        // Whether this build and the processor it runs on can use an instruction set
+        bool IsSupported(Isa Target);
+        // The widest supported instruction set
+        Isa Detect();
+        const char *Name(Isa Target);
+        void EvalRow(Isa Target, double alpha, double r, const double *rOther, int n, double *Val, double *Der);
+    } // namespace PairKernel
+
+    /**
+     * The same pair function for one fixed alpha, interpolated from a table instead of worked out. With
+     * x = alpha*R, f(x) = x^3/(1+x) is stored with f' and f'' on a uniform grid from 0 to alpha*RMax; the value
+     * is the cubic Hermite interpolant of f and f', and the derivative that of f' and f''. Pairs further apart
+     * than RMax fall back to the analytic form.
+     *
+     * Build() refines the grid until both agree with the analytic form to within Tolerance, relative for
+     * values above 1 and absolute below, checked at the quarter points of every interval. The exponent enters
+     * the penalty function as exp(-g), so an absolute error in it is the relative error of the penalty.
+     * It throws if the grid would need more than MaxIntervals intervals.
+     */
+    class PairTable
+    {
+    public:
+        // Finest grid tried by default, 8 * 2^21 doubles take 128 MB
+        static const int DefaultMaxIntervals = 1 << 21;
+
+        void Build(double alpha, double RMax, double Tolerance, int MaxIntervals = DefaultMaxIntervals);
+        // Same rows as PairKernel::EvalRow, AVX-512 runs the AVX2 path
+        void EvalRow(PairKernel::Isa Target, double r, const double *rOther, int n, double *Val, double *Der) const;
+
+        double Alpha = 0.0;
+        double XMax = 0.0;
+        int Intervals = 0;
+        // Largest error found against the analytic form when the grid was accepted
+        double Error = 0.0;
+
+    private:
+        void Fill();
+        // Both interpolants of every interval as cubics in the position within it, the value first and then the
+        // derivative over R, one cache line each
+        std::vector<double> Coeffs;
+        double Step = 0.0, InvStep = 0.0;
+    };
+} // namespace FlexiBLE
+
+#endif /*REFERENCE_FLEXIBLE_PAIR_KERNEL_H_*/
@@ -18,7 +18,9 @@ extern "C" void registerKernelFactories()
     for (int i = 0; i < Platform::getNumPlatforms(); i++)
     {
         Platform &platform = Platform::getPlatform(i);
-        if (dynamic_cast<ReferencePlatform *>(&platform) != NULL)
+        // Platforms derived from Reference, such as CPU, keep their own kernel when its plugin was loaded first
+        if (dynamic_cast<ReferencePlatform *>(&platform) != NULL &&
+            (platform.getName() == "Reference" || !platform.supportsKernels({CalcFlexiBLEForceKernel::Name()})))
         {
             ReferenceFlexiBLEKernelFactory *factory = new ReferenceFlexiBLEKernelFactory();
             platform.registerKernelFactory(CalcFlexiBLEForceKernel::Name(), factory);
@@ -25,6 +25,8 @@
 #include <cmath>
 #include <chrono>
 #include <fstream>
+#include <sstream>
+#include <mutex>
 
 using namespace FlexiBLE;
 using namespace OpenMM;
@@ -72,7 +74,48 @@ void ReferenceCalcFlexiBLEForceKernel::initialize(const System &system, const Fl
             }
         }
     }
+    Topology.assign(NumGroups, GroupTopology());
+    for (int i = 0; i < NumGroups; i++)
+    {
+        GroupTopology &Group = Topology[i];
+        Group.QMSize = QMGroups[i].size();
+        Group.Start.assign(1, 0);
+        for (int j = 0; j < QMGroups[i].size() + MMGroups[i].size(); j++)
+        {
+            const InternalInfo &Molecule = j < Group.QMSize ? QMGroups[i][j] : MMGroups[i][j - Group.QMSize];
+            Group.Atoms.insert(Group.Atoms.end(), Molecule.Indices.begin(), Molecule.Indices.end());
+            Group.Masses.insert(Group.Masses.end(), Molecule.AtomMasses.begin(), Molecule.AtomMasses.end());
+            Group.Start.emplace_back(Group.Atoms.size());
+            double MoleculeMass = 0.0;
+            for (double m : Molecule.AtomMasses)
+                MoleculeMass += m;
+            if (MoleculeMass == 0.0)
+                MoleculeMass = 1.0;
+            Group.InvMasses.emplace_back(1.0 / MoleculeMass);
+            for (double m : Molecule.AtomMasses)
+                Group.Weights.emplace_back(m / MoleculeMass);
+        }
+    }
+    // The QM atoms of every group, then the MM ones, in the order the COM sums them
+    SystemTotalMass = 0.0;
+    for (int part = 0; part < 2; part++)
+    {
+        for (const GroupTopology &Group : Topology)
+        {
+            const int QMEnd = Group.Start[Group.QMSize];
+            const int first = part == 0 ? 0 : QMEnd, last = part == 0 ? QMEnd : Group.Atoms.size();
+            for (int k = first; k < last; k++)
+                SystemTotalMass += Group.Masses[k];
+        }
+    }
+    for (GroupTopology &Group : Topology)
+    {
+        Group.SystemWeights.resize(Group.Masses.size());
+        for (int k = 0; k < Group.Masses.size(); k++)
+            Group.SystemWeights[k] = Group.Masses[k] / SystemTotalMass;
+    }
     AssignedAtomIndex = force.GetAssignedIndex();
+    DraggedAtoms.clear();
     Coefficients = force.GetAlphas();
     BoundaryShape = force.GetBoundaryType();
     BoundaryParameters = force.GetBoundaryParameters();
@@ -82,523 +125,199 @@ void ReferenceCalcFlexiBLEForceKernel::initialize(const System &system, const Fl
     FlexiBLEMaxIt = force.GetMaxIt();
     IterScales = force.GetScales();
     CutoffMethod = force.GetCutoffMethod();
-    T = force.GetTemperature();
-    EnableValOutput = force.GetValOutput();
-}
-
-vector<double> ReferenceCalcFlexiBLEForceKernel::Calc_VecMinus(vector<double> lhs, vector<double> rhs)
-{
-    vector<double> result;
-    for (int i = 0; i < 3; i++)
+    EnumerationOrder = force.GetEnumerationOrder();
+    CanonicalParents = force.GetCanonicalParents();
+    WarmStart = force.GetWarmStart();
+    MaxNodes = force.GetMaxNodes();
+    PairCutoff = force.GetPairCutoff();
+    PairIsa = PairKernel::Detect();
+    PairTables.clear();
+    if (force.GetPairTableTolerance() > 0.0)
     {
-        result.emplace_back(rhs[i] - lhs[i]);
+        PairTables.resize(NumGroups);
+        for (int i = 0; i < NumGroups; i++)
+            PairTables[i].Build(Coefficients[i], PairCutoff > 0.0 ? PairCutoff : UnderflowCutoff(Coefficients[i]), force.GetPairTableTolerance());
     }
-    return result;
-}
-
-vector<double> ReferenceCalcFlexiBLEForceKernel::Calc_VecSum(std::vector<double> lhs, std::vector<double> rhs)
-{
-    vector<double> result;
-    for (int i = 0; i < 3; i++)
-    {
-        result.emplace_back(rhs[i] + lhs[i]);
-    }
-    return result;
-}
-
-double ReferenceCalcFlexiBLEForceKernel::Calc_VecDot(vector<double> lhs, vector<double> rhs)
-{
-    double result = 0.0;
-    for (int i = 0; i < 3; i++)
+    NumThreads = force.GetNumThreads();
+    if (NumThreads != 1)
+        OwnedPool.reset(new ThreadPool(NumThreads));
+    else
+        OwnedPool.reset();
+    Pool = OwnedPool.get();
+    T = force.GetTemperature();
+    EnableValOutput = force.GetValOutput();
+    Scratch.clear();
+    for (int i = 0; i < NumGroups; i++)
     {
-        result += lhs[i] * rhs[i];
+        Scratch.emplace_back(new StepScratch());
+        if (Topology[i].NumMolecules() > 0)
+            Scratch[i]->Reserve(Topology[i].NumMolecules(), Topology[i].Start[1]);
     }
-    return result;
 }
 
-double ReferenceCalcFlexiBLEForceKernel::Calc_VecMod(vector<double> lhs)
+ReferenceCalcFlexiBLEForceKernel::StepScratch &ReferenceCalcFlexiBLEForceKernel::GetScratch(int iGroup)
 {
-    double result = 0.0;
-    for (int i = 0; i < 3; i++)
-    {
-        result += lhs[i] * lhs[i];
-    }
-    double module = sqrt(result);
-    return module;
+    while ((int)Scratch.size() <= iGroup)
+        Scratch.emplace_back(new StepScratch());
+    return *Scratch[iGroup];
 }
 
-vector<double> ReferenceCalcFlexiBLEForceKernel::Calc_COM(vector<Vec3> Coordinates, int QMFlag, int group, int index)
+Vec3 ReferenceCalcFlexiBLEForceKernel::Calc_COM(const vector<Vec3> &Coordinates, const MoleculeView &Molecule)
 {
-    vector<double> COMCoordinate = {0.0, 0.0, 0.0};
-    double totalMass = 0.0;
-    InternalInfo Molecule;
-    if (QMFlag == 1)
-        Molecule = QMGroups[group][index];
-    else if (QMFlag == 0)
-        Molecule = MMGroups[group][index];
-
-    for (int i = 0; i < Molecule.Indices.size(); i++)
+    Vec3 COMCoordinate(0.0, 0.0, 0.0);
+    for (int i = 0; i < Molecule.Size; i++)
     {
-        totalMass += Molecule.AtomMasses[i];
         for (int j = 0; j < 3; j++)
         {
-            COMCoordinate[j] += Molecule.AtomMasses[i] * Coordinates[Molecule.Indices[i]][j];
+            COMCoordinate[j] += Molecule.Weights[i] * Coordinates[Molecule.Indices[i]][j];
         }
     }
-    if (totalMass == 0.0)
-        totalMass = 1.0;
-    for (int i = 0; i < 3; i++)
-        COMCoordinate[i] /= totalMass;
     return COMCoordinate;
 }
 
-void ReferenceCalcFlexiBLEForceKernel::Calc_r(vector<pair<int, double>> &rCA, vector<vector<double>> &rCA_Vec, vector<Vec3> Coordinates, int iGroup, int TargetAtom, vector<vector<double>> &drCA)
+void ReferenceCalcFlexiBLEForceKernel::Calc_SystemCOM(const vector<Vec3> &Coordinates)
 {
-    rCA.clear();
-    rCA_Vec.clear();
-    drCA.clear();
-    // Calculate the COM if needed
-    if (BoundaryShape == 0 || BoundaryShape == 2)
+    COM = Vec3(0.0, 0.0, 0.0);
+    // The QM atoms of every group, then the MM ones
+    for (int part = 0; part < 2; part++)
     {
-        COM = {0.0, 0.0, 0.0}; // Initialize it
-        // Calculate the center of mass
-        double TotalMassCurrent = 0.0;
-        for (int i = 0; i < QMGroups.size(); i++)
-        {
-            for (int j = 0; j < QMGroups[i].size(); j++)
-            {
-                for (int k = 0; k < QMGroups[i][j].Indices.size(); k++)
-                {
-                    TotalMassCurrent += QMGroups[i][j].AtomMasses[k];
-                    for (int l = 0; l < 3; l++)
-                    {
-                        COM[l] += QMGroups[i][j].AtomMasses[k] * Coordinates[QMGroups[i][j].Indices[k]][l];
-                    }
-                }
-            }
-        }
-        for (int i = 0; i < MMGroups.size(); i++)
+        for (const GroupTopology &Group : Topology)
         {
-            for (int j = 0; j < MMGroups[i].size(); j++)
+            const int QMEnd = Group.Start[Group.QMSize];
+            const int first = part == 0 ? 0 : QMEnd, last = part == 0 ? QMEnd : Group.Atoms.size();
+            for (int k = first; k < last; k++)
             {
-                for (int k = 0; k < MMGroups[i][j].Indices.size(); k++)
+                for (int l = 0; l < 3; l++)
                 {
-                    TotalMassCurrent += MMGroups[i][j].AtomMasses[k];
-                    for (int l = 0; l < 3; l++)
-                    {
-                        COM[l] += MMGroups[i][j].AtomMasses[k] * Coordinates[MMGroups[i][j].Indices[k]][l];
-                    }
+                    COM[l] += Group.SystemWeights[k] * Coordinates[Group.Atoms[k]][l];
                 }
             }
         }
-
-        for (int i = 0; i < 3; i++)
-            COM[i] /= TotalMassCurrent;
-
-        SystemTotalMass = TotalMassCurrent;
     }
-    // Use center of mass as the spherical boundary center
-    if (BoundaryShape == 0)
-    {
-        for (int j = 0; j < QMGroups[iGroup].size(); j++)
-        {
-            double R = 0.0;
-            vector<double> tempVec; // vector of center to molecule
-            vector<double> MoleculeVec;
-            if (TargetAtom == -1)
-            {
-                MoleculeVec = Calc_COM(Coordinates, 1, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    MoleculeVec.emplace_back(Coordinates[QMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
+}
 
-            for (int l = 0; l < 3; l++)
-            {
-                tempVec.emplace_back(MoleculeVec[l] - COM[l]);
-                R += pow(COM[l] - MoleculeVec[l], 2.0);
-            }
-            R = sqrt(R);
-            pair<int, double> temp;
-            temp.second = R;
-            temp.first = j;
-            rCA.emplace_back(temp);
-            rCA_Vec.emplace_back(tempVec);
-        }
-        for (int j = 0; j < MMGroups[iGroup].size(); j++)
-        {
-            double R = 0.0;
-            vector<double> tempVec;
-            vector<double> MoleculeVec;
-            if (TargetAtom == -1)
-            {
-                MoleculeVec = Calc_COM(Coordinates, 0, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    MoleculeVec.emplace_back(Coordinates[MMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
-            for (int l = 0; l < 3; l++)
-            {
-                tempVec.emplace_back(MoleculeVec[l] - COM[l]);
-                R += pow(COM[l] - MoleculeVec[l], 2.0);
-            }
-            R = sqrt(R);
-            pair<int, double> temp;
-            temp.second = R;
-            temp.first = j + QMGroups[iGroup].size();
-            rCA.emplace_back(temp);
-            rCA_Vec.emplace_back(tempVec);
-        }
-    }
-    // Use a user-defined spherical boundary that centers at a given point
-    else if (BoundaryShape == 1)
+template <class Shape, bool UseCOM>
+void ReferenceCalcFlexiBLEForceKernel::Calc_rGroup(const Shape &Boundary, vector<pair<int, double>> &rCA, vector<Vec3> &rCA_Vec, const vector<Vec3> &Coordinates, const GroupTopology &Group, int TargetAtom)
+{
+    const int NumMolecules = Group.NumMolecules();
+    rCA.resize(NumMolecules);
+    rCA_Vec.resize(NumMolecules);
+    for (int j = 0; j < NumMolecules; j++)
     {
-        for (int j = 0; j < QMGroups[iGroup].size(); j++)
-        {
-            double R = 0.0;
-            vector<double> tempVec;
-            vector<double> MoleculeVec;
-            if (TargetAtom == -1)
-            {
-                MoleculeVec = Calc_COM(Coordinates, 1, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    MoleculeVec.emplace_back(Coordinates[QMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
-            for (int k = 0; k < 3; k++)
-            {
-                tempVec.emplace_back(MoleculeVec[k] - BoundaryParameters[iGroup][k]);
-                R += pow(MoleculeVec[k] - BoundaryParameters[iGroup][k], 2.0);
-            }
-            R = sqrt(R);
-            pair<int, double> temp;
-            temp.first = j;
-            temp.second = R;
-            rCA.emplace_back(temp);
-            rCA_Vec.emplace_back(tempVec);
-        }
-        for (int j = 0; j < MMGroups[iGroup].size(); j++)
-        {
-            double R = 0.0;
-            vector<double> tempVec;
-            vector<double> MoleculeVec;
-            if (TargetAtom == -1)
-            {
-                MoleculeVec = Calc_COM(Coordinates, 0, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    MoleculeVec.emplace_back(Coordinates[MMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
-            for (int k = 0; k < 3; k++)
-            {
-                tempVec.emplace_back(MoleculeVec[k] - BoundaryParameters[iGroup][k]);
-                R += pow(MoleculeVec[k] - BoundaryParameters[iGroup][k], 2.0);
-            }
-            R = sqrt(R);
-            pair<int, double> temp;
-            temp.first = j + QMGroups[iGroup].size();
-            temp.second = R;
-            rCA.emplace_back(temp);
-            rCA_Vec.emplace_back(tempVec);
-        }
+        const MoleculeView Molecule = Group.Molecule(j);
+        const Vec3 p = UseCOM ? Calc_COM(Coordinates, Molecule) : Coordinates[Molecule.Indices[TargetAtom]];
+        rCA[j].first = j;
+        Boundary.Measure(p, rCA[j].second, rCA_Vec[j]);
     }
-    // Use a capsule boundary defined by a line segment as the center, but the center of it is the COM.
-    else if (BoundaryShape == 2)
+}
+
+template <class Shape>
+void ReferenceCalcFlexiBLEForceKernel::Calc_rShape(vector<pair<int, double>> &rCA, vector<Vec3> &rCA_Vec, const vector<Vec3> &Coordinates, int iGroup, int TargetAtom)
+{
+    const Shape Boundary(COM, iGroup < BoundaryParameters.size() ? BoundaryParameters[iGroup].data() : nullptr);
+    if (TargetAtom == -1)
+        Calc_rGroup<Shape, true>(Boundary, rCA, rCA_Vec, Coordinates, Topology[iGroup], TargetAtom);
+    else
+        Calc_rGroup<Shape, false>(Boundary, rCA, rCA_Vec, Coordinates, Topology[iGroup], TargetAtom);
+}
+
+void ReferenceCalcFlexiBLEForceKernel::Calc_r(vector<pair<int, double>> &rCA, vector<Vec3> &rCA_Vec, const vector<Vec3> &Coordinates, int iGroup, int TargetAtom)
+{
+    switch (BoundaryShape)
     {
-        vector<double> LVec = {BoundaryParameters[iGroup][0], BoundaryParameters[iGroup][1], BoundaryParameters[iGroup][2]};
-        vector<double> halfLVec;
-        for (int i = 0; i < 3; i++)
-            halfLVec.emplace_back(LVec[i] / 2.0);
+    case 0:
+        Calc_rShape<BoundaryShapes::COMSphere>(rCA, rCA_Vec, Coordinates, iGroup, TargetAtom);
+        break;
+    case 1:
+        Calc_rShape<BoundaryShapes::FixedSphere>(rCA, rCA_Vec, Coordinates, iGroup, TargetAtom);
+        break;
+    case 2:
+        Calc_rShape<BoundaryShapes::COMCapsule>(rCA, rCA_Vec, Coordinates, iGroup, TargetAtom);
+        break;
+    case 3:
+        Calc_rShape<BoundaryShapes::FixedCapsule>(rCA, rCA_Vec, Coordinates, iGroup, TargetAtom);
+        break;
+    // Use a molecule as the boundary center so that QM particles are always closer to it, to be implemented
+    default:
+        rCA.clear();
+        rCA_Vec.clear();
+        break;
+    }
+}
 
-        double LMod = Calc_VecMod(LVec);
-        vector<double> L1 = Calc_VecMinus(halfLVec, COM);
-        vector<double> L2 = Calc_VecSum(COM, halfLVec);
-        // cout << L1[0] << " " << L1[1] << " " << L1[2] << endl;
-        // cout << L2[0] << " " << L2[1] << " " << L2[2] << endl;
-        for (int j = 0; j < QMGroups[iGroup].size(); j++)
-        {
-            vector<double> pVec;
-            if (TargetAtom == -1)
-            {
-                pVec = Calc_COM(Coordinates, 1, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    pVec.emplace_back(Coordinates[QMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
-            vector<double> RVec = Calc_VecMinus(L1, pVec);
-            double RMod = Calc_VecMod(RVec);
-            double lMod = Calc_VecDot(RVec, LVec) / LMod;
-            double R = 0.0;
-            vector<double> tempVec;
-            pair<int, double> temp;
-            if (lMod < LMod && lMod > 0)
-            {
-                R = sqrt(max(RMod * RMod - lMod * lMod, 0.0));
-                temp.first = j;
-                temp.second = R;
-                vector<double> intersection;
-                for (int k = 0; k < 3; k++)
-                {
-                    intersection.emplace_back(L1[k] + LVec[k] * (lMod / LMod));
-                }
-                tempVec = Calc_VecMinus(intersection, pVec);
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
-            }
-            else if (lMod <= 0 || lMod >= LMod)
-            {
-                if (lMod <= 0)
-                {
-                    tempVec = RVec;
-                }
-                else if (lMod >= LMod)
-                {
-                    tempVec = Calc_VecMinus(L2, pVec);
-                }
-                R = Calc_VecMod(tempVec);
-                temp.first = j;
-                temp.second = R;
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
-            }
-        }
-        for (int j = 0; j < MMGroups[iGroup].size(); j++)
-        {
-            vector<double> pVec;
-            if (TargetAtom == -1)
-            {
-                pVec = Calc_COM(Coordinates, 0, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    pVec.emplace_back(Coordinates[MMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
-            vector<double> RVec = Calc_VecMinus(L1, pVec);
-            double RMod = Calc_VecMod(RVec);
-            double lMod = Calc_VecDot(RVec, LVec) / LMod;
-            double R = 0.0;
-            vector<double> tempVec;
-            pair<int, double> temp;
-            if (lMod < LMod && lMod > 0)
-            {
-                R = sqrt(RMod * RMod - lMod * lMod);
-                temp.first = j + QMGroups[iGroup].size();
-                temp.second = R;
-                vector<double> intersection;
-                for (int k = 0; k < 3; k++)
-                {
-                    intersection.emplace_back(L1[k] + LVec[k] * (lMod / LMod));
-                }
-                tempVec = Calc_VecMinus(intersection, pVec);
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
-            }
-            else if (lMod <= 0 || lMod >= LMod)
-            {
-                if (lMod <= 0)
-                {
-                    tempVec = RVec;
-                }
-                else if (lMod >= LMod)
-                {
-                    tempVec = Calc_VecMinus(L2, pVec);
-                }
-                R = Calc_VecMod(tempVec);
-                temp.first = j + QMGroups[iGroup].size();
-                temp.second = R;
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
-            }
-        }
+void ReferenceCalcFlexiBLEForceKernel::SelectDraggedAtoms(const vector<Vec3> &Reference)
+{
+    if (AssignedAtomIndex.size() > 0)
+    {
+        DraggedAtoms = AssignedAtomIndex;
+        return;
     }
-    // Use a capsule boundary defined by a line segment as the center, line segment is freely defined in space, the center is fixed on a given point.
-    else if (BoundaryShape == 3)
+    DraggedAtoms.assign(Topology.size(), -2);
+    for (int i = 0; i < Topology.size(); i++)
     {
-        vector<double> L1 = {BoundaryParameters[iGroup][0], BoundaryParameters[iGroup][1], BoundaryParameters[iGroup][2]};
-        vector<double> L2 = {BoundaryParameters[iGroup][3], BoundaryParameters[iGroup][4], BoundaryParameters[iGroup][5]};
-        vector<double> LVec = Calc_VecMinus(L1, L2);
-        double LMod = Calc_VecMod(LVec);
-        for (int j = 0; j < QMGroups[iGroup].size(); j++)
+        if (Topology[i].NumMolecules() == 0)
+            continue;
+        // Calculate the geometric center of current kind of molecule
+        const MoleculeView Molecule = Topology[i].Molecule(0);
+        Vec3 Centroid(0.0, 0.0, 0.0);
+        for (int j = 0; j < Molecule.Size; j++)
         {
-            vector<double> pVec;
-            if (TargetAtom == -1)
-            {
-                pVec = Calc_COM(Coordinates, 1, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    pVec.emplace_back(Coordinates[QMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
-            vector<double> RVec = Calc_VecMinus(L1, pVec);
-            double RMod = Calc_VecMod(RVec);
-            double lMod = Calc_VecDot(RVec, LVec) / LMod;
-            double R = 0.0;
-            vector<double> tempVec;
-            pair<int, double> temp;
-            if (lMod < LMod && lMod > 0)
-            {
-                R = sqrt(max(RMod * RMod - lMod * lMod, 0.0));
-                temp.first = j;
-                temp.second = R;
-                vector<double> intersection;
-                for (int k = 0; k < 3; k++)
-                {
-                    intersection.emplace_back(L1[k] + LVec[k] * (lMod / LMod));
-                }
-                tempVec = Calc_VecMinus(intersection, pVec);
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
-            }
-            else if (lMod <= 0 || lMod >= LMod)
+            for (int k = 0; k < 3; k++)
             {
-                if (lMod <= 0)
-                {
-                    tempVec = RVec;
-                }
-                else if (lMod >= LMod)
-                {
-                    tempVec = Calc_VecMinus(L2, pVec);
-                }
-                R = Calc_VecMod(tempVec);
-                temp.first = j;
-                temp.second = R;
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
+                Centroid[k] += Reference[Molecule.Indices[j]][k] / ((double)Molecule.Size);
             }
         }
-        for (int j = 0; j < MMGroups[iGroup].size(); j++)
+        // Find the atom that is heaviest and closest to the centroid by the mass/r ratio. Each atom is measured
+        // at its own position, so the choice is not simply the heaviest atom.
+        double RatioNow = -1;
+        for (int j = 0; j < Molecule.Size; j++)
         {
-            vector<double> pVec;
-            if (TargetAtom == -1)
-            {
-                pVec = Calc_COM(Coordinates, 0, iGroup, j);
-            }
-            else if (TargetAtom >= 0)
-            {
-                for (int l = 0; l < 3; l++)
-                    pVec.emplace_back(Coordinates[MMGroups[iGroup][j].Indices[TargetAtom]][l]);
-            }
-            vector<double> RVec = Calc_VecMinus(L1, pVec);
-            double RMod = Calc_VecMod(RVec);
-            double lMod = Calc_VecDot(RVec, LVec) / LMod;
-            double R = 0.0;
-            vector<double> tempVec;
-            pair<int, double> temp;
-            if (lMod < LMod && lMod > 0)
+            const Vec3 d = Centroid - Reference[Molecule.Indices[j]];
+            const double dr = sqrt(d.dot(d));
+            if (dr < 10e-5 && Molecule.Masses[j] > 2.1)
             {
-                R = sqrt(RMod * RMod - lMod * lMod);
-                temp.first = j + QMGroups[iGroup].size();
-                temp.second = R;
-                vector<double> intersection;
-                for (int k = 0; k < 3; k++)
-                {
-                    intersection.emplace_back(L1[k] + LVec[k] * (lMod / LMod));
-                }
-                tempVec = Calc_VecMinus(intersection, pVec);
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
+                DraggedAtoms[i] = j;
+                break;
             }
-            else if (lMod <= 0 || lMod >= LMod)
+            if (dr > 10e-5)
             {
-                if (lMod <= 0)
-                {
-                    tempVec = RVec;
-                }
-                else if (lMod >= LMod)
+                if (Molecule.Masses[j] / dr > RatioNow)
                 {
-                    tempVec = Calc_VecMinus(L2, pVec);
+                    RatioNow = Molecule.Masses[j] / dr;
+                    DraggedAtoms[i] = j;
                 }
-                R = Calc_VecMod(tempVec);
-                temp.first = j + QMGroups[iGroup].size();
-                temp.second = R;
-                rCA.emplace_back(temp);
-                rCA_Vec.emplace_back(tempVec);
             }
         }
     }
-    // Use a molecule as the boundary center so that QM particles are always closer to it
-    else if (BoundaryShape == 4)
-    {
-        // To be implemented
-    }
 }
 
-void ReferenceCalcFlexiBLEForceKernel::Calc_dr(int iGroup, int AtomDragged, vector<pair<int, double>> rCA, vector<vector<double>> rCA_Vec, vector<vector<double>> &drCA)
+void ReferenceCalcFlexiBLEForceKernel::Calc_dr(int iGroup, int AtomDragged, const vector<pair<int, double>> &rCA, const vector<Vec3> &rCA_Vec, vector<Vec3> &drCA)
 {
     drCA.clear();
     if (AtomDragged >= 0)
     {
         for (int i = 0; i < rCA.size(); i++)
-        {
-            vector<double> gradient;
-            for (int k = 0; k < 3; k++)
-                gradient.emplace_back(rCA_Vec[i][k] / rCA[i].second);
-            drCA.emplace_back(gradient);
-        }
+            drCA.emplace_back(rCA_Vec[i][0] / rCA[i].second, rCA_Vec[i][1] / rCA[i].second, rCA_Vec[i][2] / rCA[i].second);
     }
 
     else if (AtomDragged == -1)
     {
-        for (int j = 0; j < QMGroups[iGroup].size(); j++)
-        {
-            double totalMass = 0.0;
-            for (int n = 0; n < QMGroups[iGroup][j].AtomMasses.size(); n++)
-                totalMass += QMGroups[iGroup][j].AtomMasses[n];
-            if (totalMass == 0.0)
-                totalMass = 1.0;
-            vector<double> dCOM; // Store the derivative of dx(COM-origin)/dx(i)
-            for (int n = 0; n < QMGroups[iGroup][j].AtomMasses.size(); n++)
-                dCOM.emplace_back(QMGroups[iGroup][j].AtomMasses[n] / totalMass);
-            vector<double> gradient; // Store the part of dr/dx(COM-origin)
-            for (int k = 0; k < 3; k++)
-                gradient.emplace_back(rCA_Vec[j][k] / rCA[j].second);
-
-            for (int n = 0; n < dCOM.size(); n++)
-            {
-                vector<double> tempGrad;
-                for (int k = 0; k < 3; k++)
-                    tempGrad.emplace_back(gradient[k] * dCOM[n]);
-                drCA.emplace_back(tempGrad);
-            }
-        }
-        for (int j = 0; j < MMGroups[iGroup].size(); j++)
+        for (int j = 0; j < rCA.size(); j++)
         {
-            double totalMass = 0.0;
-            for (int n = 0; n < MMGroups[iGroup][j].AtomMasses.size(); n++)
-                totalMass += MMGroups[iGroup][j].AtomMasses[n];
-            if (totalMass == 0.0)
-                totalMass = 1.0;
-            vector<double> dCOM; // Store the derivative of dx(COM-origin)/dx(i)
-            for (int n = 0; n < MMGroups[iGroup][j].AtomMasses.size(); n++)
-                dCOM.emplace_back(MMGroups[iGroup][j].AtomMasses[n] / totalMass);
-            vector<double> gradient;
-            for (int k = 0; k < 3; k++)
-                gradient.emplace_back(rCA_Vec[j + QMGroups[iGroup].size()][k] / rCA[j + QMGroups[iGroup].size()].second);
-
-            for (int n = 0; n < dCOM.size(); n++)
+            const MoleculeView Molecule = Topology[iGroup].Molecule(j);
+            // The part of dr/dx(COM-origin)
+            const Vec3 gradient(rCA_Vec[j][0] / rCA[j].second, rCA_Vec[j][1] / rCA[j].second, rCA_Vec[j][2] / rCA[j].second);
+            // Times the derivative of dx(COM-origin)/dx(i)
+            for (int n = 0; n < Molecule.Size; n++)
             {
-                vector<double> tempGrad;
-                for (int k = 0; k < 3; k++)
-                    tempGrad.emplace_back(gradient[k] * dCOM[n]);
-                drCA.emplace_back(tempGrad);
+                const double dCOM = Molecule.Weights[n];
+                drCA.emplace_back(gradient[0] * dCOM, gradient[1] * dCOM, gradient[2] * dCOM);
             }
         }
     }
 }
 
-void ReferenceCalcFlexiBLEForceKernel::TestReordering(int Switch, int GroupIndex, int DragIndex, std::vector<OpenMM::Vec3> coor, std::vector<std::pair<int, double>> rAtom, vector<double> COM)
+void ReferenceCalcFlexiBLEForceKernel::TestReordering(int Switch, int GroupIndex, int DragIndex, const vector<Vec3> &coor, const vector<pair<int, double>> &rAtom, const Vec3 &COM)
 {
     if (Switch == 1)
     {
@@ -653,28 +372,30 @@ double ReferenceCalcFlexiBLEForceKernel::CalcPairExpPart(double alpha, double R,
     return result;
 }
 
-void ReferenceCalcFlexiBLEForceKernel::TestPairFunc(int EnableTestOutput, vector<vector<gInfo>> gExpPart)
+// Write out the full pair table by original index, every pair is worked out once and read in both directions
+void ReferenceCalcFlexiBLEForceKernel::TestPairFunc(int EnableTestOutput, double alpha, const vector<pair<int, double>> &rC_Atom_re)
 {
     if (EnableTestOutput == 1)
     {
+        const int N = rC_Atom_re.size();
+        PairBand Pairs;
+        Pairs.Layout(rC_Atom_re, 0, N, 0.0);
+        for (int a = 1; a < N; a++)
+            PairKernel::EvalRow(PairKernel::Scalar, alpha, Pairs.R[a], &Pairs.R[0], a, &Pairs.PairVal[Pairs.Index(a, 0)], &Pairs.PairDer[Pairs.Index(a, 0)]);
         remove("gExpPart.txt");
         fstream foutII("gExpPart.txt", ios::out);
         foutII << "Values" << endl;
-        for (int i = 0; i < gExpPart.size(); i++)
+        for (int i = 0; i < N; i++)
         {
-            for (int j = 0; j < gExpPart[i].size(); j++)
-            {
-                foutII << setprecision(8) << gExpPart[i][j].val << " ";
-            }
+            for (int j = 0; j < N; j++)
+                foutII << setprecision(8) << Pairs.Get(i, j).val << " ";
             foutII << endl;
         }
         foutII << "Derivatives" << endl;
-        for (int i = 0; i < gExpPart.size(); i++)
+        for (int i = 0; i < N; i++)
         {
-            for (int j = 0; j < gExpPart[i].size(); j++)
-            {
-                foutII << setprecision(8) << gExpPart[i][j].der << " ";
-            }
+            for (int j = 0; j < N; j++)
+                foutII << setprecision(8) << Pairs.Get(i, j).der << " ";
             foutII << endl;
         }
     }
@@ -684,7 +405,7 @@ void ReferenceCalcFlexiBLEForceKernel::TestPairFunc(int EnableTestOutput, vector
 // it needs to be initialized before call this function.
 // QMSize = NumImpQM for denominators
 // int part is a flag for denominator and numerator, part = 0 for numerator and part = 1 for denominator
-double ReferenceCalcFlexiBLEForceKernel::CalcPenalFunc(vector<int> seq, int QMSize, vector<vector<gInfo>> g, vector<double> &DerList, vector<pair<int, double>> rC_Atom, double h, int part)
+double ReferenceCalcFlexiBLEForceKernel::CalcPenalFunc(const vector<int> &seq, int QMSize, const vector<vector<gInfo>> &g, vector<double> &DerList, const vector<pair<int, double>> &rC_Atom, double h, int part)
 {
     // Calculate the penalty function
     double ExpPart = 0.0;
@@ -732,509 +453,1279 @@ double ReferenceCalcFlexiBLEForceKernel::CalcPenalFunc(vector<int> seq, int QMSi
     return result;
 }
 
-int ReferenceCalcFlexiBLEForceKernel::FindRepeat(unordered_set<string> Nodes, string InputNode)
+double ReferenceCalcFlexiBLEForceKernel::CalcPenalFunc(const vector<int> &seq, int QMSize, const PairBand &Band, vector<double> &DerList, const vector<pair<int, double>> &rC_Atom, double h, int part, int iGroup)
 {
-    if (Nodes.find(InputNode) != Nodes.end())
-        return 1;
-    else
-        return 0;
-}
-
-void ReferenceCalcFlexiBLEForceKernel::ProdChild(unordered_set<string> &Nodes, string InputNode, double h, int QMSize, int LB, vector<vector<gInfo>> g, vector<double> &DerList, vector<pair<int, double>> rC_Atom, double &sumOfDeno)
-{
-    vector<int> Node(InputNode.size(), 0);
-    int QMNow = 0, MMNow = QMSize;
-    for (int i = 0; i < InputNode.size(); i++)
+    // Runs of consecutive ranks holding the same kind of molecule, a QM molecule only pairs with the MM runs
+    // inside of it and an MM molecule with the QM runs outside of it. A molecule outside of the band is fine on
+    // its own side, a QM molecule beyond it or an MM one inside of it pairs beyond the cutoff.
+    StepScratch &S = GetScratch(iGroup);
+    vector<char> &Kind = S.Kind;
+    Kind.assign(Band.Size, 0);
+    for (int i = 0; i < seq.size(); i++)
     {
-        if (InputNode[i] == '1')
-        {
-            Node[QMNow] = i + LB;
-            QMNow++;
-        }
-        else
+        const int a = Band.Rank[rC_Atom[seq[i]].first];
+        if (a >= 0 && a < Band.Size)
+            Kind[a] = i < QMSize ? 1 : 2;
+        else if ((i < QMSize) != (a < 0))
+            return 0.0;
+    }
+    vector<pair<int, int>> &QMRuns = S.QMRuns, &MMRuns = S.MMRuns;
+    QMRuns.clear();
+    MMRuns.clear();
+    for (int a = 0; a < Band.Size;)
+    {
+        int end = a + 1;
+        while (end < Band.Size && Kind[end] == Kind[a])
+            end++;
+        if (Kind[a] == 1)
+            QMRuns.emplace_back(a, end);
+        else if (Kind[a] == 2)
+            MMRuns.emplace_back(a, end);
+        a = end;
+    }
+    double ExpPart = 0.0;
+    for (const pair<int, int> &run : QMRuns)
+    {
+        for (int a = run.first; a < run.second; a++)
         {
-            Node[MMNow] = i + LB;
-            MMNow++;
+            for (int r = 0; r < MMRuns.size() && MMRuns[r].first < a; r++)
+                ExpPart += Band.RowVal(a, MMRuns[r].first, MMRuns[r].second);
         }
     }
-    vector<double> temp((int)DerList.size(), 0.0);
-    double nodeVal = CalcPenalFunc(Node, QMSize, g, temp, rC_Atom, h, 1);
-    if (nodeVal >= h)
+    double result = exp(-ExpPart);
+    if ((result >= h) || (result < h && CutoffMethod == 1) || (part == 0))
     {
-        if (FindRepeat(Nodes, InputNode) == 0)
+        for (const pair<int, int> &run : QMRuns)
         {
-            sumOfDeno += nodeVal;
-            for (int i = 0; i < (int)temp.size(); i++)
+            for (int a = run.first; a < run.second; a++)
             {
-                DerList[i] += temp[i];
-            }
-            Nodes.insert(InputNode);
-            for (int i = 0; i < (int)InputNode.size() - 1; i++)
-            {
-                string child = InputNode;
-                if (InputNode[i] == '1' && InputNode[i + 1] == '0')
-                {
-                    child[i] = '0';
-                    child[i + 1] = '1';
-                    ProdChild(Nodes, child, h, QMSize, LB, g, DerList, rC_Atom, sumOfDeno);
-                }
+                double der = 0.0;
+                for (int r = 0; r < MMRuns.size() && MMRuns[r].first < a; r++)
+                    der += -Band.RowDer(a, MMRuns[r].first, MMRuns[r].second);
+                DerList[Band.Order[a]] += der * result;
             }
         }
-    }
-    else if (nodeVal < h && CutoffMethod == 1)
-    {
-        if (FindRepeat(Nodes, InputNode) == 0)
+        for (const pair<int, int> &run : MMRuns)
         {
-            Nodes.insert(InputNode);
-            sumOfDeno += nodeVal;
-            for (int i = 0; i < (int)temp.size(); i++)
+            for (int b = run.first; b < run.second; b++)
             {
-                DerList[i] += temp[i];
+                double der = 0.0;
+                for (int r = (int)QMRuns.size() - 1; r >= 0 && QMRuns[r].second > b; r--)
+                    der += Band.ColDer(b, QMRuns[r].first, QMRuns[r].second);
+                DerList[Band.Order[b]] += der * result;
             }
         }
     }
+    return result;
 }
 
-void ReferenceCalcFlexiBLEForceKernel::TestNumeDeno(int EnableValOutput, double Nume, vector<double> h_list, double alpha, double h, double scale, int QMSize, int MMSize, vector<double> NumeForce, vector<double> DenoForce, double DenoNow, double DenoLast, vector<Vec3> Forces)
+double ReferenceCalcFlexiBLEForceKernel::CalcNodeFull(const DenominatorContext &ctx, const uint64_t *Node, double *NodeDer)
 {
-    if (EnableValOutput == 1)
+    // Only a QM molecule further from the center than an MM one makes a non-zero pair, so each QM position
+    // takes the runs of MM positions inside of it from the row sums, and each MM position the runs of QM
+    // positions outside of it from the column sums.
+    const PairBand &B = *ctx.Band;
+    const int base = ctx.BandBase, n = ctx.NodeSize;
+    double ExpPart = 0.0;
+    for (int x = NodeBits::NextSet(Node, 0, n); x < n; x = NodeBits::NextSet(Node, x + 1, n))
     {
-        remove("Nume&Deno.txt");
-        fstream fout("Nume&Deno.txt", ios::out);
-        fout << "Parameters" << endl;
-        fout << "alpha= " << alpha << endl;
-        fout << "h_thre= " << h << endl;
-        fout << "Scale= " << scale << endl;
-        fout << "QMSize= " << QMSize << endl;
-        fout << "MMSize= " << MMSize << endl;
-        fout << "Results" << endl;
-        fout << "h(Numerator)= " << Nume << endl;
-        fout << "Numerator_derivative" << endl;
-        for (int i = 0; i < NumeForce.size(); i++)
-        {
-            if (i == 0)
-                fout << NumeForce[i];
-            else
-                fout << " " << NumeForce[i];
-        }
-        fout << endl;
-        fout << "h_list" << endl;
-        for (int i = 0; i < h_list.size(); i++)
-        {
-            if (i == 0)
-                fout << h_list[i];
-            else
-                fout << " " << h_list[i];
-        }
-        fout << endl;
-        // fout << "Node_list" << endl;
-        // for (const auto &node : NodeList)
-        //{
-        //     fout << node << endl;
-        // }
-        fout << setprecision(12) << "Last_Denominator= " << DenoLast << endl;
-        fout << setprecision(12) << "Final_Denominator= " << DenoNow << endl;
-        fout << "Denominator_derivative" << endl;
-        for (int i = 0; i < DenoForce.size(); i++)
+        double der = 0.0;
+        for (int y = NodeBits::NextClear(Node, 0, x); y < x;)
         {
-            if (i == 0)
-                fout << DenoForce[i];
-            else
-                fout << " " << DenoForce[i];
+            const int end = NodeBits::NextSet(Node, y, x);
+            ExpPart += B.RowVal(base + x, base + y, base + end);
+            der += B.RowDer(base + x, base + y, base + end);
+            y = NodeBits::NextClear(Node, end, x);
         }
-        fout << endl;
-        fout << "Force" << endl;
-        for (int i = 0; i < Forces.size(); i++)
+        NodeDer[x] = der;
+    }
+    for (int y = NodeBits::NextClear(Node, 0, n); y < n; y = NodeBits::NextClear(Node, y + 1, n))
+    {
+        double der = 0.0;
+        for (int x = NodeBits::NextSet(Node, y + 1, n); x < n;)
         {
-            fout << i << " " << fixed << setprecision(12) << Forces[i][0] << " " << fixed << setprecision(12) << Forces[i][1] << " " << fixed << setprecision(12) << Forces[i][2] << endl;
+            const int end = NodeBits::NextClear(Node, x, n);
+            der += B.ColDer(base + y, base + x, base + end);
+            x = NodeBits::NextSet(Node, end, n);
         }
+        NodeDer[y] = der;
     }
+    return ExpPart;
 }
 
-double ReferenceCalcFlexiBLEForceKernel::execute(ContextImpl &context, bool includeForces, bool includeEnergy)
+double ReferenceCalcFlexiBLEForceKernel::CalcSwapExp(const DenominatorContext &ctx, const uint64_t *Parent, int i, double ParentExp)
 {
-    /*In this function, all objects that uses the rearranged index by distance from
-     *center to the atom will contain an extension "_re".
-     */
-    double Energy = 0.0;
-    vector<Vec3> &Positions = extractPositions(context);
-    vector<Vec3> &Force = extractForces(context);
-    int NumGroups = (int)QMGroups.size();
-    for (int i = 0; i < NumGroups; i++)
+    // Position i turns from QM to MM and position i + 1 from MM to QM, all other pairs are untouched. Both
+    // only pair with the MM runs before i and the QM runs after i + 1.
+    const PairBand &B = *ctx.Band;
+    const int base = ctx.BandBase, a = base + i;
+    double delta = B.RowVal(a + 1, a, a + 1);
+    for (int y = NodeBits::NextClear(Parent, 0, i); y < i;)
     {
-        if (QMGroups[i].size() != 0 && MMGroups[i].size() != 0)
+        const int end = NodeBits::NextSet(Parent, y, i);
+        delta += B.RowVal(a + 1, base + y, base + end) - B.RowVal(a, base + y, base + end);
+        y = NodeBits::NextClear(Parent, end, i);
+    }
+    for (int x = NodeBits::NextSet(Parent, i + 2, ctx.NodeSize); x < ctx.NodeSize;)
+    {
+        const int end = NodeBits::NextClear(Parent, x, ctx.NodeSize);
+        delta += B.ColVal(a, base + x, base + end) - B.ColVal(a + 1, base + x, base + end);
+        x = NodeBits::NextSet(Parent, end, ctx.NodeSize);
+    }
+    return ParentExp + delta;
+}
+
+void ReferenceCalcFlexiBLEForceKernel::CalcSwapDer(const DenominatorContext &ctx, const uint64_t *Parent, int i, const double *ParentDer, double *ChildDer)
+{
+    const PairBand &B = *ctx.Band;
+    const int base = ctx.BandBase, a = base + i;
+    const double swapped = B.Der(a + 1, a);
+    double sumI = swapped, sumI1 = swapped;
+    for (int y = 0; y < i; y++)
+    {
+        if (NodeBits::Test(Parent, y))
+            ChildDer[y] = ParentDer[y];
+        else
         {
-            // Decide which atom to apply force to
-            int AtomDragged = -2;
-            if (AssignedAtomIndex.size() > 0)
-                AtomDragged = AssignedAtomIndex[i];
-            else if (AssignedAtomIndex.size() == 0)
-            {
-                // Calculate the geometric center of current kind of molecule
-                vector<int> Points;
-                vector<double> Masses;
-                if (QMGroups[i].size() > 0)
-                {
-                    Points = QMGroups[i][0].Indices;
-                    Masses = QMGroups[i][0].AtomMasses;
-                }
-                else
-                {
-                    Points = MMGroups[i][0].Indices;
-                    Masses = MMGroups[i][0].AtomMasses;
-                }
-                vector<double> Centroid = {0.0, 0.0, 0.0};
-                for (int j = 0; j < Points.size(); j++)
-                {
-                    for (int k = 0; k < 3; k++)
-                    {
-                        Centroid[k] += Positions[Points[j]][k] / ((double)Points.size());
-                    }
-                }
-                // Find the atom that is heaviest and closest to the centroid by the mass/r ratio.
-                double RatioNow = -1;
+            const double derI = B.Der(a, base + y), derI1 = B.Der(a + 1, base + y);
+            ChildDer[y] = ParentDer[y] - derI + derI1;
+            sumI1 += derI1;
+        }
+    }
+    for (int x = i + 2; x < ctx.NodeSize; x++)
+    {
+        if (NodeBits::Test(Parent, x))
+        {
+            const double derI = B.Der(base + x, a), derI1 = B.Der(base + x, a + 1);
+            ChildDer[x] = ParentDer[x] + derI - derI1;
+            sumI += derI;
+        }
+        else
+            ChildDer[x] = ParentDer[x];
+    }
+    ChildDer[i] = sumI;
+    ChildDer[i + 1] = sumI1;
+}
 
-                for (int j = 0; j < Points.size(); j++)
-                {
-                    double dr = 0;
-                    for (int k = 0; k < 3; k++)
-                    {
-                        dr += pow(Centroid[k] - Positions[Points[i]][k], 2.0);
-                    }
-                    dr = sqrt(dr);
-                    if (dr < 10e-5 && Masses[j] > 2.1)
-                    {
-                        AtomDragged = j;
-                        break;
-                    }
-                    if (dr > 10e-5)
-                    {
-                        if (Masses[j] / dr > RatioNow)
-                        {
-                            RatioNow = Masses[j] / dr;
-                            AtomDragged = j;
-                        }
-                    }
-                }
-            }
-            // Store the distance from atom to the boundary center, the extension "re" means
-            // the order is rearranged by the distance from center to atom.
-            // vector<pair<int, double>> rCenter_Atom;
-            vector<pair<int, double>> rCenter_Atom; // Dimension matches the number of molecules
-            vector<pair<int, double>> rCenter_Atom_re;
-            // Store the vector from boundary center to atom or molecule COM
-            vector<vector<double>> rCenter_Atom_Vec;
-            // The derivative
-            vector<vector<double>> drCenter_Atom_Vec;
-            Calc_r(rCenter_Atom, rCenter_Atom_Vec, Positions, i, AtomDragged, drCenter_Atom_Vec);
-            // Keep one in order of original index
-            rCenter_Atom_re = rCenter_Atom;
-            // Rearrange molecules by distances
-            std::stable_sort(rCenter_Atom_re.begin(), rCenter_Atom_re.end(), [](const pair<int, double> &lhs, const pair<int, double> &rhs)
-                             { return lhs.second < rhs.second; });
-            /*if (rCenter_Atom_re[0].second == 0)
+void ReferenceCalcFlexiBLEForceKernel::AddNodeDer(const DenominatorContext &ctx, const uint64_t *Node, const double *NodeDer, double NodeVal, double *WinDer)
+{
+    for (int k = 0; k < ctx.NodeSize; k++)
+    {
+        if (NodeBits::Test(Node, k))
+            WinDer[k] -= NodeDer[k] * NodeVal;
+        else
+            WinDer[k] += NodeDer[k] * NodeVal;
+    }
+}
+
+bool ReferenceCalcFlexiBLEForceKernel::IsFrontierOwner(const DenominatorContext &ctx, const uint64_t *Child, int i, double ChildExp)
+{
+    // The child agrees with its parent left of i - 1, so its '0','1' pairs there are the parent's ones.
+    // Swapping one of them back only changes pairs of those two positions, which CalcSwapExp gives.
+    for (int k = 0; k < i - 1; k++)
+    {
+        if (NodeBits::Test(Child, k) || !NodeBits::Test(Child, k + 1))
+            continue;
+        const double parentExp = ChildExp - CalcSwapExp(ctx, Child, k, 0.0);
+        if (exp(-parentExp) >= ctx.h)
+            return false;
+    }
+    return true;
+}
+
+template <int NWords>
+void ReferenceCalcFlexiBLEForceKernel::InsertNode(DenominatorContext &ctx, const uint64_t *Node)
+{
+    if (!CanonicalParents || ctx.Warm)
+        ctx.template Nodes<NWords>().Insert(Node);
+    if (MaxNodes > 0 && ++ctx.NumVisited > MaxNodes)
+    {
+        stringstream msg;
+        msg << "FlexiBLE: The denominator enumeration exceeded the limit of " << MaxNodes << " nodes, raise the threshold or the node limit";
+        throw OpenMMException(msg.str());
+    }
+}
+
+template <int NWords>
+size_t ReferenceCalcFlexiBLEForceKernel::AcceptNode(DenominatorContext &ctx, const uint64_t *Node, double NodeExp)
+{
+    InsertNode<NWords>(ctx, Node);
+    if (ctx.Warm)
+        ctx.Accepted.insert(ctx.Accepted.end(), Node, Node + ctx.Words);
+    const size_t slot = ctx.Work.Push();
+    NodeBits::Copy<NWords>(ctx.Work.Key(slot), Node, ctx.Words);
+    ctx.Work.Exp(slot) = NodeExp;
+    return slot;
+}
+
+template <int NWords>
+void ReferenceCalcFlexiBLEForceKernel::KeepFrontier(DenominatorContext &ctx, const uint64_t *Node, const double *NodeDer, double NodeExp)
+{
+    InsertNode<NWords>(ctx, Node);
+    const double nodeVal = exp(-NodeExp);
+    if (!ctx.Warm)
+    {
+        ctx.Deno += nodeVal;
+        AddNodeDer(ctx, Node, NodeDer, nodeVal, ctx.NodeSums);
+        return;
+    }
+    ctx.Frontier.insert(ctx.Frontier.end(), Node, Node + ctx.Words);
+    ctx.FrontierExp.push_back(NodeExp);
+    if (CutoffMethod == 1)
+    {
+        ctx.FrontDeno += nodeVal;
+        AddNodeDer(ctx, Node, NodeDer, nodeVal, ctx.FrontDer.data());
+    }
+}
+
+template <int NWords>
+void ReferenceCalcFlexiBLEForceKernel::ProdChild(DenominatorContext &ctx)
+{
+    NodeTable<NWords> &Nodes = ctx.template Nodes<NWords>();
+    NodeWorkList &Work = ctx.Work;
+    uint64_t *node = ctx.Node.data();
+    double *nodeDer = ctx.NodeDer.data();
+    uint64_t *child = ctx.Child.data();
+    // A warm start looks rejected children up again later, so it always keeps the table
+    const bool canonical = CanonicalParents && !ctx.Warm;
+    while (!Work.Empty())
+    {
+        // The popped slot may be reused by the children, so the node is copied out first
+        const size_t slot = EnumerationOrder == 1 ? Work.PopFront() : Work.PopBack();
+        NodeBits::Copy<NWords>(node, Work.Key(slot), ctx.Words);
+        const double *slotDer = Work.Der(slot);
+        for (int k = 0; k < ctx.NodeSize; k++)
+            nodeDer[k] = slotDer[k];
+        const double nodeExp = Work.Exp(slot);
+        const double nodeVal = exp(-nodeExp);
+        ctx.Deno += nodeVal;
+        AddNodeDer(ctx, node, nodeDer, nodeVal, ctx.NodeSums);
+        // Children are scored from this node's cached exponent and derivatives, and only if not visited yet
+        const int lastOwned = canonical ? NodeBits::FirstRise(node, ctx.NodeSize) + 1 : ctx.NodeSize;
+        for (int i = 0; i < ctx.NodeSize - 1; i++)
+        {
+            if (!NodeBits::Test(node, i) || NodeBits::Test(node, i + 1))
+                continue;
+            if (i > lastOwned && CutoffMethod != 1)
+                break;
+            NodeBits::Copy<NWords>(child, node, ctx.Words);
+            NodeBits::SwapDown(child, i);
+            if (!canonical && Nodes.Contains(child))
+                continue;
+            const double childExp = CalcSwapExp(ctx, node, i, nodeExp);
+            const double childVal = exp(-childExp);
+            if (childVal >= ctx.h)
             {
-                double minDistance = 1.0e-8;
-                if (minDistance >= rCenter_Atom_re[1].second)
-                    minDistance = rCenter_Atom_re[1].second / 10.0;
-                rCenter_Atom_re[0].second = minDistance;
-                rCenter_Atom[rCenter_Atom_re[0].first].second = minDistance;
-            }*/
-            for (int j = 0; j < rCenter_Atom_re.size(); j++)
+                if (i > lastOwned)
+                    continue;
+                const size_t childSlot = AcceptNode<NWords>(ctx, child, childExp);
+                CalcSwapDer(ctx, node, i, nodeDer, Work.Der(childSlot));
+            }
+            else if (CutoffMethod == 1 || ctx.Warm)
             {
-                double minDistance = 1.0e-8;
-                if (rCenter_Atom_re[j].second > 0.0)
-                    break;
-                else if (rCenter_Atom_re[j].second == 0.0)
-                {
-                    rCenter_Atom_re[j].second = minDistance;
-                    rCenter_Atom[rCenter_Atom_re[j].first].second = minDistance;
-                }
+                // Every child below the threshold is kept, but not expanded
+                if (canonical && !IsFrontierOwner(ctx, child, i, childExp))
+                    continue;
+                if (CutoffMethod == 1)
+                    CalcSwapDer(ctx, node, i, nodeDer, ctx.ChildDer.data());
+                KeepFrontier<NWords>(ctx, child, ctx.ChildDer.data(), childExp);
             }
-            Calc_dr(i, AtomDragged, rCenter_Atom, rCenter_Atom_Vec, drCenter_Atom_Vec);
-            // Check if the reordering is working
-            TestReordering(EnableTestOutput, i, AtomDragged, Positions, rCenter_Atom_re, COM);
-            // Start the force and energy calculation
-            int IterNum = FlexiBLEMaxIt[i];
-            // double ConvergeLimit = IterGamma[i];
-            const double ScaleFactor = IterScales[i];
-            double h = hThre[i];
-            double gamma = hThre[i];
-            const double AlphaNow = Coefficients[i];
-            const int QMSize = QMGroups[i].size();
-            const int MMSize = MMGroups[i].size();
-            const int NAtoms = QMGroups[i][0].Indices.size();
-            vector<Vec3> ForceList(QMSize + MMSize, Vec3(0.0, 0.0, 0.0));
-            if (AtomDragged == -1)
-                ForceList.resize((QMSize + MMSize) * NAtoms, Vec3(0.0, 0.0, 0.0));
-
-            vector<double> hList_re(QMSize + MMSize, 0.0);
-            // Store the exponential part's value and derivative over distance of pair functions
-            vector<vector<gInfo>> gExpPart;
-            vector<double> dDen_dr(QMSize + MMSize, 0.0);
-            vector<double> dNume_dr(QMSize + MMSize, 0.0);
-            vector<double> df_dr(QMSize + MMSize, 0.0);
-            double DenVal = 0.0, NumeVal = 0.0;
-
-            // It's stored in the index the same as rCenter_Atom
-            for (int j = 0; j < QMSize + MMSize; j++)
+        }
+    }
+}
+
+bool ReferenceCalcFlexiBLEForceKernel::PopParallel(DenominatorContext &ctx, int ThreadIndex, double &NodeExp)
+{
+    DenominatorWorker &self = *ctx.Workers[ThreadIndex];
+    const int nWorkers = (int)ctx.Workers.size();
+    while (!ctx.OverBudget.load())
+    {
+        // Own nodes first, in the chosen order, then the oldest node of another thread
+        for (int k = 0; k < nWorkers; k++)
+        {
+            DenominatorWorker &victim = *ctx.Workers[(ThreadIndex + k) % nWorkers];
+            lock_guard<mutex> lock(victim.Lock);
+            if (victim.Work.Empty())
+                continue;
+            const size_t slot = (k > 0 || EnumerationOrder == 1) ? victim.Work.PopFront() : victim.Work.PopBack();
+            memcpy(self.Node.data(), victim.Work.Key(slot), ctx.Words * sizeof(uint64_t));
+            memcpy(self.NodeDer.data(), victim.Work.Der(slot), ctx.NodeSize * sizeof(double));
+            NodeExp = victim.Work.Exp(slot);
+            ctx.Queued--;
+            return true;
+        }
+        if (ctx.Pending.load() == 0)
+            return false;
+        // Every node left is being expanded by another thread, sleep until one pushes a child or the walk ends
+        ctx.Waiting++;
+        {
+            unique_lock<mutex> lock(ctx.IdleLock);
+            ctx.Idle.wait(lock, [&ctx]
+                          { return ctx.Queued.load() > 0 || ctx.Pending.load() == 0 || ctx.OverBudget.load(); });
+        }
+        ctx.Waiting--;
+    }
+    return false;
+}
+
+void ReferenceCalcFlexiBLEForceKernel::WakeIdle(DenominatorContext &ctx, bool All)
+{
+    // A waiting thread counts itself before it checks for work, so either it sees the change or it is seen here
+    if (ctx.Waiting.load() == 0)
+        return;
+    {
+        lock_guard<mutex> lock(ctx.IdleLock);
+    }
+    if (All)
+        ctx.Idle.notify_all();
+    else
+        ctx.Idle.notify_one();
+}
+
+template <int NWords>
+void ReferenceCalcFlexiBLEForceKernel::ProdChildParallel(DenominatorContext &ctx, int ThreadIndex)
+{
+    ShardedNodeTable<NWords> &Nodes = ctx.template SharedNodes<NWords>();
+    DenominatorWorker &self = *ctx.Workers[ThreadIndex];
+    uint64_t *node = self.Node.data();
+    double *nodeDer = self.NodeDer.data();
+    uint64_t *child = self.Child.data();
+    double nodeExp = 0.0;
+    while (PopParallel(ctx, ThreadIndex, nodeExp))
+    {
+        const double nodeVal = exp(-nodeExp);
+        self.Deno += nodeVal;
+        for (int k = 0; k < ctx.NodeSize; k++)
+            self.WinDer[k] += NodeBits::Test(node, k) ? -nodeDer[k] * nodeVal : nodeDer[k] * nodeVal;
+        const int lastOwned = CanonicalParents ? NodeBits::FirstRise(node, ctx.NodeSize) + 1 : ctx.NodeSize;
+        for (int i = 0; i < ctx.NodeSize - 1; i++)
+        {
+            if (!NodeBits::Test(node, i) || NodeBits::Test(node, i + 1))
+                continue;
+            if (i > lastOwned && CutoffMethod != 1)
+                break;
+            NodeBits::Copy<NWords>(child, node, ctx.Words);
+            NodeBits::SwapDown(child, i);
+            if (!CanonicalParents && Nodes.Contains(child))
+                continue;
+            const double childExp = CalcSwapExp(ctx, node, i, nodeExp);
+            const double childVal = exp(-childExp);
+            if (childVal < ctx.h && CutoffMethod != 1)
+                continue;
+            if (CanonicalParents)
             {
-                vector<gInfo> temp;
-                temp.resize(QMSize + MMSize);
-                gExpPart.emplace_back(temp);
+                // Each child has a single owner, so the threads never race for it
+                if (childVal >= ctx.h ? i > lastOwned : !IsFrontierOwner(ctx, child, i, childExp))
+                    continue;
             }
-            for (int j = 0; j < QMSize + MMSize; j++)
+            // Another thread may have reached the same child meanwhile, only the one inserting it goes on
+            else if (!Nodes.Insert(child))
+                continue;
+            if (MaxNodes > 0 && ++ctx.NumVisited > MaxNodes)
             {
-                for (int k = 0; k < QMSize + MMSize; k++)
-                {
-                    if (j == k)
-                    {
-                        gExpPart[j][k].val = 0.0;
-                        gExpPart[j][k].der = 0.0;
-                    }
-                    else
-                    {
-                        double Rjk = rCenter_Atom[j].second - rCenter_Atom[k].second;
-                        double der = 0.0;
-                        gExpPart[j][k].val = CalcPairExpPart(AlphaNow, Rjk, der);
-                        gExpPart[j][k].der = der;
-                    }
-                }
+                ctx.OverBudget = true;
+                WakeIdle(ctx, true);
             }
-            TestPairFunc(EnableTestOutput, gExpPart);
-
-            // Calculate all the h^QM and h^MM values
-            for (int p = 0; p < QMSize; p++)
+            if (childVal >= ctx.h)
             {
-                double ExpPart = 0.0;
-                for (int j = p + 1; j <= QMSize; j++)
+                ctx.Pending++;
                 {
-                    ExpPart += gExpPart[rCenter_Atom_re[j].first][rCenter_Atom_re[p].first].val;
+                    lock_guard<mutex> lock(self.Lock);
+                    const size_t childSlot = self.Work.Push();
+                    NodeBits::Copy<NWords>(self.Work.Key(childSlot), child, ctx.Words);
+                    CalcSwapDer(ctx, node, i, nodeDer, self.Work.Der(childSlot));
+                    self.Work.Exp(childSlot) = childExp;
+                    ctx.Queued++;
                 }
-                hList_re[p] = exp(-ExpPart);
+                WakeIdle(ctx, false);
             }
-            for (int q = QMSize; q < QMSize + MMSize; q++)
+            else
             {
-                double ExpPart = 0.0;
-                for (int j = QMSize - 1; j < q; j++)
-                {
-                    ExpPart += gExpPart[rCenter_Atom_re[q].first][rCenter_Atom_re[j].first].val;
-                }
-                hList_re[q] = exp(-ExpPart);
+                // Every child below the threshold is kept, but not expanded
+                double *childDer = self.ChildDer.data();
+                CalcSwapDer(ctx, node, i, nodeDer, childDer);
+                self.Deno += childVal;
+                for (int k = 0; k < ctx.NodeSize; k++)
+                    self.WinDer[k] += NodeBits::Test(child, k) ? -childDer[k] * childVal : childDer[k] * childVal;
             }
+        }
+        if (--ctx.Pending == 0)
+            WakeIdle(ctx, true);
+    }
+}
 
-            // Calculate the numerator
-            vector<int> NumeSeq;
-            for (int j = 0; j < QMSize + MMSize; j++)
+template <int NWords>
+double ReferenceCalcFlexiBLEForceKernel::CalcDenominator(DenominatorContext &ctx, int QMSize)
+{
+    if (!CanonicalParents)
+        ctx.template Nodes<NWords>().Reset(ctx.Words);
+    ctx.NumVisited = 0;
+    ctx.Work.Reset(ctx.Words, ctx.NodeSize);
+    uint64_t *perfect = ctx.Node.data();
+    NodeBits::MakePerfect(perfect, ctx.Words, QMSize);
+    const double perfectExp = CalcNodeFull(ctx, perfect, ctx.NodeDer.data());
+    const double perfectVal = exp(-perfectExp);
+    if (perfectVal >= ctx.h && Pool && !GroupsInParallel)
+    {
+        const int nThreads = Pool->getNumThreads();
+        while ((int)ctx.Workers.size() < nThreads)
+            ctx.Workers.emplace_back(new DenominatorWorker());
+        for (int t = 0; t < nThreads; t++)
+        {
+            DenominatorWorker &worker = *ctx.Workers[t];
+            worker.Work.Reset(ctx.Words, ctx.NodeSize);
+            worker.Node.resize(ctx.Words);
+            worker.Child.resize(ctx.Words);
+            worker.NodeDer.resize(ctx.NodeSize);
+            worker.ChildDer.resize(ctx.NodeSize);
+            worker.WinDer.assign(ctx.NodeSize, 0.0);
+            worker.Deno = 0.0;
+        }
+        if (!CanonicalParents)
+        {
+            ctx.template SharedNodes<NWords>().Reset(ctx.Words);
+            ctx.template SharedNodes<NWords>().Insert(perfect);
+        }
+        ctx.NumVisited = 1;
+        ctx.OverBudget = false;
+        ctx.Pending = 1;
+        ctx.Queued = 1;
+        ctx.Waiting = 0;
+        NodeWorkList &Work = ctx.Workers[0]->Work;
+        const size_t slot = Work.Push();
+        NodeBits::Copy<NWords>(Work.Key(slot), perfect, ctx.Words);
+        for (int k = 0; k < ctx.NodeSize; k++)
+            Work.Der(slot)[k] = ctx.NodeDer[k];
+        Work.Exp(slot) = perfectExp;
+        Pool->execute([&](ThreadPool &pool, int threadIndex) { ProdChildParallel<NWords>(ctx, threadIndex); });
+        Pool->waitForThreads();
+        if (ctx.OverBudget)
+        {
+            stringstream msg;
+            msg << "FlexiBLE: The denominator enumeration exceeded the limit of " << MaxNodes << " nodes, raise the threshold or the node limit";
+            throw OpenMMException(msg.str());
+        }
+        for (int t = 0; t < nThreads; t++)
+        {
+            const DenominatorWorker &worker = *ctx.Workers[t];
+            ctx.Deno += worker.Deno;
+            for (int k = 0; k < ctx.NodeSize; k++)
+                ctx.WinDer[k] += worker.WinDer[k];
+        }
+    }
+    else if (perfectVal >= ctx.h)
+    {
+        const size_t slot = AcceptNode<NWords>(ctx, perfect, perfectExp);
+        for (int k = 0; k < ctx.NodeSize; k++)
+            ctx.Work.Der(slot)[k] = ctx.NodeDer[k];
+        ProdChild<NWords>(ctx);
+    }
+    else if (CutoffMethod == 1)
+        KeepFrontier<NWords>(ctx, perfect, ctx.NodeDer.data(), perfectExp);
+    vector<double> &DerList = *ctx.DerList;
+    for (int k = 0; k < ctx.NodeSize; k++)
+        DerList[ctx.WinIdx[k]] += ctx.WinDer[k];
+    return ctx.Deno;
+}
+
+template <int NWords>
+double ReferenceCalcFlexiBLEForceKernel::CalcDenominatorWarm(DenominatorContext &ctx, int QMSize, int LB, bool Restart)
+{
+    NodeTable<NWords> &Nodes = ctx.template Nodes<NWords>();
+    vector<double> &DerList = *ctx.DerList;
+    const int oldSize = ctx.WarmNodeSize, oldWords = ctx.WarmWords;
+    const int dq = ctx.WarmLB - LB, dm = ctx.NodeSize - oldSize - dq;
+    // Only a window grown on both sides at a lower threshold keeps the old nodes valid
+    const bool resume = !Restart && ctx.WarmValid && ctx.WarmSource == ctx.Source && ctx.WarmVersion == ctx.SourceVersion && dq >= 0 && dm >= 0 && ctx.h <= ctx.WarmH && NodeWordClass(ctx.NodeSize) == NodeWordClass(oldSize);
+    ctx.Warm = true;
+    ctx.WarmValid = false;
+    ctx.Work.Reset(ctx.Words, ctx.NodeSize);
+    if (!resume)
+    {
+        Nodes.Reset(ctx.Words);
+        ctx.NumVisited = 0;
+        ctx.Accepted.clear();
+        ctx.Frontier.clear();
+        ctx.FrontierExp.clear();
+        ctx.AccDeno = 0.0;
+        ctx.FrontDeno = 0.0;
+        ctx.AccDer.assign(ctx.NodeSize, 0.0);
+        ctx.FrontDer.assign(ctx.NodeSize, 0.0);
+        uint64_t *perfect = ctx.Node.data();
+        NodeBits::MakePerfect(perfect, ctx.Words, QMSize);
+        const double perfectExp = CalcNodeFull(ctx, perfect, ctx.NodeDer.data());
+        if (exp(-perfectExp) >= ctx.h)
+        {
+            const size_t slot = AcceptNode<NWords>(ctx, perfect, perfectExp);
+            for (int k = 0; k < ctx.NodeSize; k++)
+                ctx.Work.Der(slot)[k] = ctx.NodeDer[k];
+        }
+        else
+            KeepFrontier<NWords>(ctx, perfect, ctx.NodeDer.data(), perfectExp);
+    }
+    else
+    {
+        // The new molecules inside the old window are QM and the ones outside are MM, they pair with nothing
+        // already in a node, so every old node keeps its exponent and NodeDer after moving up by dq positions.
+        const size_t nAccepted = ctx.Accepted.size() / oldWords, nFrontier = ctx.FrontierExp.size();
+        ctx.Remapped.resize(nAccepted * ctx.Words);
+        for (size_t n = 0; n < nAccepted; n++)
+            NodeBits::Embed(&ctx.Remapped[n * ctx.Words], ctx.Words, &ctx.Accepted[n * oldWords], oldSize, dq);
+        ctx.Accepted.swap(ctx.Remapped);
+        ctx.Remapped.resize(nFrontier * ctx.Words);
+        for (size_t n = 0; n < nFrontier; n++)
+            NodeBits::Embed(&ctx.Remapped[n * ctx.Words], ctx.Words, &ctx.Frontier[n * oldWords], oldSize, dq);
+        ctx.Frontier.swap(ctx.Remapped);
+        ctx.WinDer.assign(ctx.NodeSize, 0.0);
+        for (int k = 0; k < oldSize; k++)
+            ctx.WinDer[k + dq] = ctx.AccDer[k];
+        ctx.AccDer.swap(ctx.WinDer);
+        ctx.WinDer.assign(ctx.NodeSize, 0.0);
+        for (int k = 0; k < oldSize; k++)
+            ctx.WinDer[k + dq] = ctx.FrontDer[k];
+        ctx.FrontDer.swap(ctx.WinDer);
+        Nodes.Reset(ctx.Words, nAccepted + nFrontier);
+        for (size_t n = 0; n < nAccepted; n++)
+            Nodes.Insert(&ctx.Accepted[n * ctx.Words]);
+        for (size_t n = 0; n < nFrontier; n++)
+            Nodes.Insert(&ctx.Frontier[n * ctx.Words]);
+        ctx.NumVisited = (long long)(nAccepted + nFrontier);
+
+        // Old frontier nodes that pass the lower threshold are accepted now
+        for (size_t n = 0; n < ctx.FrontierExp.size();)
+        {
+            const double storedVal = exp(-ctx.FrontierExp[n]);
+            if (storedVal < ctx.h)
+            {
+                n++;
+                continue;
+            }
+            uint64_t *node = ctx.Node.data();
+            NodeBits::Copy<NWords>(node, &ctx.Frontier[n * ctx.Words], ctx.Words);
+            const double nodeExp = CalcNodeFull(ctx, node, ctx.NodeDer.data());
+            if (CutoffMethod == 1)
             {
-                NumeSeq.emplace_back(j);
+                ctx.FrontDeno -= storedVal;
+                AddNodeDer(ctx, node, ctx.NodeDer.data(), -storedVal, ctx.FrontDer.data());
             }
-            NumeVal = CalcPenalFunc(NumeSeq, QMSize, gExpPart, dNume_dr, rCenter_Atom, h, 0);
-            if (fabs(NumeVal) < 1.0e-14 && EnableTestOutput == 0)
-                throw OpenMMException("Bad configuration, numerator value way too small, h(Numerator) = " + to_string(NumeVal));
+            const size_t last = ctx.FrontierExp.size() - 1;
+            NodeBits::Copy<NWords>(&ctx.Frontier[n * ctx.Words], &ctx.Frontier[last * ctx.Words], ctx.Words);
+            ctx.FrontierExp[n] = ctx.FrontierExp[last];
+            ctx.Frontier.resize(last * ctx.Words);
+            ctx.FrontierExp.pop_back();
+            ctx.Accepted.insert(ctx.Accepted.end(), node, node + ctx.Words);
+            const size_t slot = ctx.Work.Push();
+            NodeBits::Copy<NWords>(ctx.Work.Key(slot), node, ctx.Words);
+            ctx.Work.Exp(slot) = nodeExp;
+            for (int k = 0; k < ctx.NodeSize; k++)
+                ctx.Work.Der(slot)[k] = ctx.NodeDer[k];
+        }
 
-            // Calculate denominator til it converges
-            double DenNow = 0.0, DenLast = 0.0;
-            for (int j = 1; j <= IterNum + 1; j++)
+        // Old accepted nodes only gain children by swapping with the new molecules at either end
+        const int edges[2] = {dq > 0 ? dq - 1 : -1, dm > 0 ? dq + oldSize - 1 : -1};
+        uint64_t *child = ctx.Child.data();
+        for (size_t n = 0; n < nAccepted; n++)
+        {
+            for (int e = 0; e < 2; e++)
             {
-                if (j > IterNum)
+                const int i = edges[e];
+                if (i < 0 || !NodeBits::Test(&ctx.Accepted[n * ctx.Words], i) || NodeBits::Test(&ctx.Accepted[n * ctx.Words], i + 1))
+                    continue;
+                NodeBits::Copy<NWords>(child, &ctx.Accepted[n * ctx.Words], ctx.Words);
+                NodeBits::SwapDown(child, i);
+                if (Nodes.Contains(child))
+                    continue;
+                const double childExp = CalcNodeFull(ctx, child, ctx.ChildDer.data());
+                if (exp(-childExp) >= ctx.h)
                 {
-                    throw OpenMMException("FlexiBLE: Reached maximum number of iteration");
-                }
-                // Pick important QM and MM molecules
-                int ImpQMlb = 0, ImpMMub = 0; // lb = lower bound & ub = upper bound
-                for (int p = QMSize - 1; p >= 0; p--)
-                {
-                    if (hList_re[p] < h)
-                    {
-                        ImpQMlb = p + 1;
-                        break;
-                    }
-                }
-                for (int q = QMSize; q < QMSize + MMSize; q++)
-                {
-                    if (hList_re[q] < h)
-                    {
-                        ImpMMub = q - 1;
-                        break;
-                    }
-                }
-                int nImpQM = QMSize - ImpQMlb;
-                int nImpMM = ImpMMub - (QMSize - 1);
-                string perfect;
-                for (int k = 0; k < nImpQM + nImpMM; k++)
-                {
-                    if (k < nImpQM)
-                        perfect.append("1");
-                    else
-                        perfect.append("0");
-                }
-                unordered_set<string> NodeList;
-                vector<double> DerListDen(QMSize + MMSize, 0.0);
-                double Deno = 0.0;
-                ProdChild(NodeList, perfect, h, nImpQM, ImpQMlb, gExpPart, DerListDen, rCenter_Atom_re, Deno);
-                if (j == 1)
-                {
-                    DenNow = Deno;
-                    DenLast = Deno;
-                    h *= ScaleFactor;
-                    if (DenNow == 1.0)
-                    {
-                        dDen_dr = DerListDen;
-                        DenVal = Deno;
-                        break;
-                    }
+                    const size_t slot = AcceptNode<NWords>(ctx, child, childExp);
+                    for (int k = 0; k < ctx.NodeSize; k++)
+                        ctx.Work.Der(slot)[k] = ctx.ChildDer[k];
                 }
                 else
-                {
-                    DenNow = Deno;
-                    if (j == IterNum)
-                    {
-                        fstream coorOut("LastCoor.txt", ios::out);
-                        for (int k = 0; k < Positions.size(); k++)
-                        {
-                            coorOut << fixed << setprecision(10) << Positions[k][0] << " " << Positions[k][1] << " " << Positions[k][2] << endl;
-                        }
-                        TestNumeDeno(EnableValOutput, NumeVal, hList_re, AlphaNow, h, ScaleFactor, QMSize, MMSize, dNume_dr, dDen_dr, DenNow, DenLast, ForceList);
-                    }
-                    if ((DenNow - DenLast) > gamma * DenLast)
-                    {
-                        h *= ScaleFactor;
-                        DenLast = DenNow;
-                    }
-                    else if ((DenNow - DenLast) <= gamma * DenLast)
-                    {
-                        dDen_dr = DerListDen;
-                        DenVal = Deno;
-                        break;
-                    }
-                }
+                    KeepFrontier<NWords>(ctx, child, ctx.ChildDer.data(), childExp);
+            }
+        }
+    }
+
+    // Only nodes that are new at this threshold are expanded, the old ones are already in the sums
+    ctx.Deno = ctx.AccDeno;
+    ctx.NodeSums = ctx.AccDer.data();
+    ProdChild<NWords>(ctx);
+    ctx.NodeSums = ctx.WinDer.data();
+    ctx.AccDeno = ctx.Deno;
+    ctx.Warm = false;
+    ctx.WarmValid = true;
+    ctx.WarmSource = ctx.Source;
+    ctx.WarmVersion = ctx.SourceVersion;
+    ctx.WarmH = ctx.h;
+    ctx.WarmLB = LB;
+    ctx.WarmNodeSize = ctx.NodeSize;
+    ctx.WarmWords = ctx.Words;
+
+    double Deno = ctx.AccDeno;
+    for (int k = 0; k < ctx.NodeSize; k++)
+        DerList[ctx.WinIdx[k]] += ctx.AccDer[k];
+    if (CutoffMethod == 1)
+    {
+        Deno += ctx.FrontDeno;
+        for (int k = 0; k < ctx.NodeSize; k++)
+            DerList[ctx.WinIdx[k]] += ctx.FrontDer[k];
+    }
+    return Deno;
+}
+
+void ReferenceCalcFlexiBLEForceKernel::PairBand::Layout(const vector<pair<int, double>> &rC_Atom, int Begin, int Count, double Cutoff)
+{
+    First = Begin;
+    Size = Count;
+    Version++;
+    Order.resize(Size);
+    Rank.resize(rC_Atom.size());
+    for (int r = 0; r < (int)rC_Atom.size(); r++)
+        Rank[rC_Atom[r].first] = r - First;
+    R.resize(Size);
+    Lo.resize(Size);
+    Hi.resize(Size);
+    Start.resize(Size);
+    RowStart.resize(Size);
+    ColStart.resize(Size);
+    int lo = 0;
+    for (int a = 0; a < Size; a++)
+    {
+        Order[a] = rC_Atom[First + a].first;
+        R[a] = rC_Atom[First + a].second;
+        while (Cutoff > 0.0 && rC_Atom[First + a].second - rC_Atom[First + lo].second > Cutoff)
+            lo++;
+        Lo[a] = lo;
+    }
+    // Lo never decreases, so neither does Hi
+    int hi = 0;
+    for (int b = 0; b < Size; b++)
+    {
+        if (hi <= b)
+            hi = b + 1;
+        while (hi < Size && Lo[hi] <= b)
+            hi++;
+        Hi[b] = hi;
+    }
+    size_t nPairs = 0, nRow = 0, nCol = 0;
+    for (int a = 0; a < Size; a++)
+    {
+        Start[a] = nPairs;
+        RowStart[a] = nRow;
+        ColStart[a] = nCol;
+        nPairs += a - Lo[a];
+        nRow += a - Lo[a] + 1;
+        nCol += Hi[a] - a;
+    }
+    PairVal.resize(nPairs);
+    PairDer.resize(nPairs);
+    RowValSum.resize(nRow);
+    RowDerSum.resize(nRow);
+    ColValSum.resize(nCol);
+    ColDerSum.resize(nCol);
+}
+
+void ReferenceCalcFlexiBLEForceKernel::PairBand::Accumulate()
+{
+    for (int a = 0; a < Size; a++)
+    {
+        const size_t row = RowStart[a] - Lo[a];
+        RowValSum[row + a] = 0.0;
+        RowDerSum[row + a] = 0.0;
+        for (int c = a - 1; c >= Lo[a]; c--)
+        {
+            RowValSum[row + c] = RowValSum[row + c + 1] + PairVal[Index(a, c)];
+            RowDerSum[row + c] = RowDerSum[row + c + 1] + PairDer[Index(a, c)];
+        }
+        // Row a extends every column it reaches by one entry, so the columns are filled in the same pass
+        for (int b = Lo[a]; b < a; b++)
+        {
+            const size_t col = ColStart[b] + (a - b);
+            ColValSum[col] = ColValSum[col - 1] + PairVal[Index(a, b)];
+            ColDerSum[col] = ColDerSum[col - 1] + PairDer[Index(a, b)];
+        }
+        ColValSum[ColStart[a]] = 0.0;
+        ColDerSum[ColStart[a]] = 0.0;
+    }
+}
+
+void ReferenceCalcFlexiBLEForceKernel::PairBand::Build(const vector<vector<gInfo>> &g, const vector<pair<int, double>> &rC_Atom, int Begin, int Count)
+{
+    Layout(rC_Atom, Begin, Count, 0.0);
+    for (int a = 0; a < Size; a++)
+    {
+        const vector<gInfo> &ga = g[Order[a]];
+        for (int c = 0; c < a; c++)
+        {
+            PairVal[Index(a, c)] = ga[Order[c]].val;
+            PairDer[Index(a, c)] = ga[Order[c]].der;
+        }
+    }
+    Accumulate();
+}
+
+void ReferenceCalcFlexiBLEForceKernel::PairBand::InterfaceSpan(const vector<pair<int, double>> &rC_Atom, int QMSize, double Cutoff, int &Begin, int &Count)
+{
+    const int N = (int)rC_Atom.size();
+    Begin = 0;
+    int End = N;
+    if (Cutoff > 0.0 && QMSize > 0 && QMSize < N)
+    {
+        const double inner = rC_Atom[QMSize].second - Cutoff, outer = rC_Atom[QMSize - 1].second + Cutoff;
+        Begin = QMSize - 1;
+        while (Begin > 0 && rC_Atom[Begin - 1].second >= inner)
+            Begin--;
+        End = QMSize + 1;
+        while (End < N && rC_Atom[End].second <= outer)
+            End++;
+    }
+    Count = End - Begin;
+}
+
+double ReferenceCalcFlexiBLEForceKernel::UnderflowCutoff(double alpha)
+{
+    // exp(-g) is exactly zero in double precision for g > 746, and g = x^3 / (1 + x) grows with x = alpha * R,
+    // so pairs beyond the root of x^3 / (1 + x) = 746 make the arrangement vanish either way
+    const double limit = 746.0;
+    double x = cbrt(limit) + 1.0;
+    for (int it = 0; it < 50; it++)
+    {
+        const double f = x * x * x / (1.0 + x) - limit;
+        const double df = (2.0 * x * x * x + 3.0 * x * x) / ((1.0 + x) * (1.0 + x));
+        const double step = f / df;
+        x -= step;
+        if (fabs(step) < 1.0e-12 * x)
+            break;
+    }
+    return x / alpha;
+}
+
+void ReferenceCalcFlexiBLEForceKernel::ImportantWindow(const vector<double> &hList, int QMSize, double h, int &ImpQMlb, int &ImpMMub)
+{
+    // With every MM molecule important the window ends at the last one, not before the first
+    const int NumMolecules = (int)hList.size();
+    ImpQMlb = 0;
+    ImpMMub = NumMolecules - 1;
+    for (int p = QMSize - 1; p >= 0; p--)
+    {
+        if (hList[p] < h)
+        {
+            ImpQMlb = p + 1;
+            break;
+        }
+    }
+    for (int q = QMSize; q < NumMolecules; q++)
+    {
+        if (hList[q] < h)
+        {
+            ImpMMub = q - 1;
+            break;
+        }
+    }
+}
+
+ReferenceCalcFlexiBLEForceKernel::DenominatorContext &ReferenceCalcFlexiBLEForceKernel::PrepareDenominator(int NodeSize, double h, int LB, const vector<vector<gInfo>> *g, const PairBand *Band, vector<double> &DerList, const vector<pair<int, double>> &rC_Atom, int iGroup)
+{
+    DenominatorContext &ctx = GetScratch(iGroup).Denominator;
+    ctx.DerList = &DerList;
+    ctx.NodeSize = NodeSize;
+    ctx.Words = NodeBits::NumWords(NodeSize);
+    ctx.h = h;
+    ctx.Deno = 0.0;
+    ctx.Warm = false;
+    ctx.WinIdx.resize(NodeSize);
+    ctx.Node.resize(ctx.Words);
+    ctx.Child.resize(ctx.Words);
+    ctx.NodeDer.resize(NodeSize);
+    ctx.ChildDer.resize(NodeSize);
+    ctx.WinDer.assign(NodeSize, 0.0);
+    ctx.NodeSums = ctx.WinDer.data();
+    for (int k = 0; k < NodeSize; k++)
+        ctx.WinIdx[k] = rC_Atom[LB + k].first;
+    if (Band == nullptr)
+    {
+        ctx.LocalBand.Build(*g, rC_Atom, LB, NodeSize);
+        ctx.Band = &ctx.LocalBand;
+        ctx.Source = g;
+        ctx.SourceVersion = 0;
+    }
+    else
+    {
+        ctx.Band = Band;
+        ctx.Source = Band;
+        ctx.SourceVersion = Band->Version;
+    }
+    ctx.BandBase = LB - ctx.Band->First;
+    if (ctx.BandBase < 0 || ctx.BandBase + NodeSize > ctx.Band->Size)
+        throw OpenMMException("FlexiBLE: The important molecules reach beyond the stored pairs");
+    return ctx;
+}
+
+int ReferenceCalcFlexiBLEForceKernel::NodeWordClass(int NodeSize)
+{
+    // Arrangements are bit-packed, windows of up to 64 or 128 molecules use fixed-width nodes
+    if (NodeSize <= 64)
+        return 1;
+    else if (NodeSize <= 128)
+        return 2;
+    else
+        return 0;
+}
+
+double ReferenceCalcFlexiBLEForceKernel::CalcDenominator(int NodeSize, double h, int QMSize, int LB, const vector<vector<gInfo>> &g, vector<double> &DerList, const vector<pair<int, double>> &rC_Atom)
+{
+    DenominatorContext &ctx = PrepareDenominator(NodeSize, h, LB, &g, nullptr, DerList, rC_Atom);
+    return RunDenominator(ctx, QMSize);
+}
+
+double ReferenceCalcFlexiBLEForceKernel::CalcDenominator(int NodeSize, double h, int QMSize, int LB, const PairBand &Band, vector<double> &DerList, const vector<pair<int, double>> &rC_Atom, int iGroup)
+{
+    DenominatorContext &ctx = PrepareDenominator(NodeSize, h, LB, nullptr, &Band, DerList, rC_Atom, iGroup);
+    return RunDenominator(ctx, QMSize);
+}
+
+double ReferenceCalcFlexiBLEForceKernel::RunDenominator(DenominatorContext &ctx, int QMSize)
+{
+    // A cold evaluation leaves nothing a later warm start could build on
+    ctx.WarmValid = false;
+    switch (NodeWordClass(ctx.NodeSize))
+    {
+    case 1:
+        return CalcDenominator<1>(ctx, QMSize);
+    case 2:
+        return CalcDenominator<2>(ctx, QMSize);
+    default:
+        return CalcDenominator<0>(ctx, QMSize);
+    }
+}
+
+double ReferenceCalcFlexiBLEForceKernel::CalcDenominatorWarm(int NodeSize, double h, int QMSize, int LB, const vector<vector<gInfo>> &g, vector<double> &DerList, const vector<pair<int, double>> &rC_Atom, bool Restart)
+{
+    DenominatorContext &ctx = PrepareDenominator(NodeSize, h, LB, &g, nullptr, DerList, rC_Atom);
+    return RunDenominatorWarm(ctx, QMSize, LB, Restart);
+}
+
+double ReferenceCalcFlexiBLEForceKernel::CalcDenominatorWarm(int NodeSize, double h, int QMSize, int LB, const PairBand &Band, vector<double> &DerList, const vector<pair<int, double>> &rC_Atom, bool Restart, int iGroup)
+{
+    DenominatorContext &ctx = PrepareDenominator(NodeSize, h, LB, nullptr, &Band, DerList, rC_Atom, iGroup);
+    return RunDenominatorWarm(ctx, QMSize, LB, Restart);
+}
+
+double ReferenceCalcFlexiBLEForceKernel::RunDenominatorWarm(DenominatorContext &ctx, int QMSize, int LB, bool Restart)
+{
+    switch (NodeWordClass(ctx.NodeSize))
+    {
+    case 1:
+        return CalcDenominatorWarm<1>(ctx, QMSize, LB, Restart);
+    case 2:
+        return CalcDenominatorWarm<2>(ctx, QMSize, LB, Restart);
+    default:
+        return CalcDenominatorWarm<0>(ctx, QMSize, LB, Restart);
+    }
+}
+
+void ReferenceCalcFlexiBLEForceKernel::TestNumeDeno(int EnableValOutput, double Nume, const vector<double> &h_list, double alpha, double h, double scale, int QMSize, int MMSize, const vector<double> &NumeForce, const vector<double> &DenoForce, double DenoNow, double DenoLast, const vector<Vec3> &Forces)
+{
+    if (EnableValOutput == 1)
+    {
+        remove("Nume&Deno.txt");
+        fstream fout("Nume&Deno.txt", ios::out);
+        fout << "Parameters" << endl;
+        fout << "alpha= " << alpha << endl;
+        fout << "h_thre= " << h << endl;
+        fout << "Scale= " << scale << endl;
+        fout << "QMSize= " << QMSize << endl;
+        fout << "MMSize= " << MMSize << endl;
+        fout << "Results" << endl;
+        fout << "h(Numerator)= " << Nume << endl;
+        fout << "Numerator_derivative" << endl;
+        for (int i = 0; i < NumeForce.size(); i++)
+        {
+            if (i == 0)
+                fout << NumeForce[i];
+            else
+                fout << " " << NumeForce[i];
+        }
+        fout << endl;
+        fout << "h_list" << endl;
+        for (int i = 0; i < h_list.size(); i++)
+        {
+            if (i == 0)
+                fout << h_list[i];
+            else
+                fout << " " << h_list[i];
+        }
+        fout << endl;
+        // fout << "Node_list" << endl;
+        // for (const auto &node : NodeList)
+        //{
+        //     fout << node << endl;
+        // }
+        fout << setprecision(12) << "Last_Denominator= " << DenoLast << endl;
+        fout << setprecision(12) << "Final_Denominator= " << DenoNow << endl;
+        fout << "Denominator_derivative" << endl;
+        for (int i = 0; i < DenoForce.size(); i++)
+        {
+            if (i == 0)
+                fout << DenoForce[i];
+            else
+                fout << " " << DenoForce[i];
+        }
+        fout << endl;
+        fout << "Force" << endl;
+        for (int i = 0; i < Forces.size(); i++)
+        {
+            fout << i << " " << fixed << setprecision(12) << Forces[i][0] << " " << fixed << setprecision(12) << Forces[i][1] << " " << fixed << setprecision(12) << Forces[i][2] << endl;
+        }
+    }
+}
+
+double ReferenceCalcFlexiBLEForceKernel::ExecuteGroup(int iGroup, const vector<Vec3> &Positions, StepScratch &S)
+{
+    vector<pair<int, double>> &rCenter_Atom = S.rCenter_Atom, &rCenter_Atom_re = S.rCenter_Atom_re;
+    vector<Vec3> &rCenter_Atom_Vec = S.rCenter_Atom_Vec, &drCenter_Atom_Vec = S.drCenter_Atom_Vec;
+    const int AtomDragged = DraggedAtoms[iGroup];
+    // Store the distance from atom to the boundary center, the extension "re" means
+    // the order is rearranged by the distance from center to atom. The buffers are kept
+    // by the kernel, so they are only allocated on the first steps.
+    Calc_r(rCenter_Atom, rCenter_Atom_Vec, Positions, iGroup, AtomDragged);
+    // Keep one in order of original index
+    rCenter_Atom_re = rCenter_Atom;
+    // Rearrange molecules by distances, ties by original index as a stable sort would leave them
+    // without the buffer it allocates
+    std::sort(rCenter_Atom_re.begin(), rCenter_Atom_re.end(), [](const pair<int, double> &lhs, const pair<int, double> &rhs)
+              { return lhs.second < rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first); });
+    /*if (rCenter_Atom_re[0].second == 0)
+    {
+        double minDistance = 1.0e-8;
+        if (minDistance >= rCenter_Atom_re[1].second)
+            minDistance = rCenter_Atom_re[1].second / 10.0;
+        rCenter_Atom_re[0].second = minDistance;
+        rCenter_Atom[rCenter_Atom_re[0].first].second = minDistance;
+    }*/
+    for (int j = 0; j < rCenter_Atom_re.size(); j++)
+    {
+        double minDistance = 1.0e-8;
+        if (rCenter_Atom_re[j].second > 0.0)
+            break;
+        else if (rCenter_Atom_re[j].second == 0.0)
+        {
+            rCenter_Atom_re[j].second = minDistance;
+            rCenter_Atom[rCenter_Atom_re[j].first].second = minDistance;
+        }
+    }
+    Calc_dr(iGroup, AtomDragged, rCenter_Atom, rCenter_Atom_Vec, drCenter_Atom_Vec);
+    // Check if the reordering is working
+    TestReordering(EnableTestOutput, iGroup, AtomDragged, Positions, rCenter_Atom_re, COM);
+    // Start the force and energy calculation
+    int IterNum = FlexiBLEMaxIt[iGroup];
+    // double ConvergeLimit = IterGamma[iGroup];
+    const double ScaleFactor = IterScales[iGroup];
+    double h = hThre[iGroup];
+    double gamma = hThre[iGroup];
+    const double AlphaNow = Coefficients[iGroup];
+    const int QMSize = QMGroups[iGroup].size();
+    const int MMSize = MMGroups[iGroup].size();
+    const int NAtoms = QMGroups[iGroup][0].Indices.size();
+    vector<Vec3> &ForceList = S.ForceList;
+    ForceList.assign(AtomDragged == -1 ? (QMSize + MMSize) * NAtoms : QMSize + MMSize, Vec3(0.0, 0.0, 0.0));
+
+    vector<double> &hList_re = S.hList_re, &dDen_dr = S.dDen_dr, &dNume_dr = S.dNume_dr, &df_dr = S.df_dr;
+    hList_re.assign(QMSize + MMSize, 0.0);
+    dDen_dr.assign(QMSize + MMSize, 0.0);
+    dNume_dr.assign(QMSize + MMSize, 0.0);
+    df_dr.assign(QMSize + MMSize, 0.0);
+    double DenVal = 0.0, NumeVal = 0.0;
+
+    // Store the exponential part's value and derivative over distance of the pair functions in rank
+    // order, only for the pairs closer than the cutoff, the others make an arrangement vanish
+    TestPairFunc(EnableTestOutput, AlphaNow, rCenter_Atom_re);
+    PairBand &Pairs = S.Pairs;
+    const double Cutoff = PairCutoff > 0.0 ? PairCutoff : UnderflowCutoff(AlphaNow);
+    int SpanBegin = 0, SpanCount = 0;
+    PairBand::InterfaceSpan(rCenter_Atom_re, QMSize, Cutoff, SpanBegin, SpanCount);
+    Pairs.Layout(rCenter_Atom_re, SpanBegin, SpanCount, Cutoff);
+    for (int a = 0; a < Pairs.Size; a++)
+    {
+        const int lo = Pairs.Lo[a];
+        if (lo == a)
+            continue;
+        if (PairTables.empty())
+            PairKernel::EvalRow(PairIsa, AlphaNow, Pairs.R[a], &Pairs.R[lo], a - lo, &Pairs.PairVal[Pairs.Index(a, lo)], &Pairs.PairDer[Pairs.Index(a, lo)]);
+        else
+            PairTables[iGroup].EvalRow(PairIsa, Pairs.R[a], &Pairs.R[lo], a - lo, &Pairs.PairVal[Pairs.Index(a, lo)], &Pairs.PairDer[Pairs.Index(a, lo)]);
+    }
+    Pairs.Accumulate();
+
+    // Calculate all the h^QM and h^MM values
+    // Outside of the band a molecule pairs beyond the cutoff with the interface one, which leaves them at 0
+    const int Interface = QMSize - Pairs.First;
+    for (int p = 0; p < QMSize; p++)
+    {
+        const int a = p - Pairs.First;
+        hList_re[p] = a < 0 ? 0.0 : exp(-Pairs.ColVal(a, a + 1, Interface + 1));
+    }
+    for (int q = QMSize; q < QMSize + MMSize; q++)
+    {
+        const int b = q - Pairs.First;
+        hList_re[q] = b >= Pairs.Size ? 0.0 : exp(-Pairs.RowVal(b, Interface - 1, b));
+    }
+
+    // Calculate the numerator
+    vector<int> &NumeSeq = S.NumeSeq;
+    NumeSeq.clear();
+    for (int j = 0; j < QMSize + MMSize; j++)
+    {
+        NumeSeq.emplace_back(j);
+    }
+    NumeVal = CalcPenalFunc(NumeSeq, QMSize, Pairs, dNume_dr, rCenter_Atom, h, 0, iGroup);
+    if (fabs(NumeVal) < 1.0e-14 && EnableTestOutput == 0)
+        throw OpenMMException("Bad configuration, numerator value way too small, h(Numerator) = " + to_string(NumeVal));
+
+    // Calculate denominator til it converges
+    double DenNow = 0.0, DenLast = 0.0;
+    for (int j = 1; j <= IterNum + 1; j++)
+    {
+        if (j > IterNum)
+        {
+            throw OpenMMException("FlexiBLE: Reached maximum number of iteration");
+        }
+        // Pick important QM and MM molecules
+        int ImpQMlb, ImpMMub; // lb = lower bound & ub = upper bound
+        ImportantWindow(hList_re, QMSize, h, ImpQMlb, ImpMMub);
+        int nImpQM = QMSize - ImpQMlb;
+        int nImpMM = ImpMMub - (QMSize - 1);
+        vector<double> &DerListDen = S.DerListDen;
+        DerListDen.assign(QMSize + MMSize, 0.0);
+        double Deno = 0.0;
+        if (WarmStart)
+            Deno = CalcDenominatorWarm(nImpQM + nImpMM, h, nImpQM, ImpQMlb, Pairs, DerListDen, rCenter_Atom_re, j == 1, iGroup);
+        else
+            Deno = CalcDenominator(nImpQM + nImpMM, h, nImpQM, ImpQMlb, Pairs, DerListDen, rCenter_Atom_re, iGroup);
+        if (j == 1)
+        {
+            DenNow = Deno;
+            DenLast = Deno;
+            h *= ScaleFactor;
+            if (DenNow == 1.0)
+            {
+                dDen_dr = DerListDen;
+                DenVal = Deno;
+                break;
             }
-            // Calculate force based on above
-            for (int j = 0; j < QMSize + MMSize; j++)
+        }
+        else
+        {
+            DenNow = Deno;
+            if (j == IterNum)
             {
-                df_dr[j] = (1.0 / NumeVal) * dNume_dr[j] - (1.0 / DenVal) * dDen_dr[j];
+                S.LastIteration = true;
+                TestNumeDeno(EnableValOutput, NumeVal, hList_re, AlphaNow, h, ScaleFactor, QMSize, MMSize, dNume_dr, dDen_dr, DenNow, DenLast, ForceList);
             }
+            if ((DenNow - DenLast) > gamma * DenLast)
+            {
+                h *= ScaleFactor;
+                DenLast = DenNow;
+            }
+            else if ((DenNow - DenLast) <= gamma * DenLast)
+            {
+                dDen_dr = DerListDen;
+                DenVal = Deno;
+                break;
+            }
+        }
+    }
+    // Calculate force based on above
+    for (int j = 0; j < QMSize + MMSize; j++)
+    {
+        df_dr[j] = (1.0 / NumeVal) * dNume_dr[j] - (1.0 / DenVal) * dDen_dr[j];
+    }
 
-            for (int j = 0; j < QMSize; j++)
+    for (int j = 0; j < QMSize; j++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            if (AtomDragged >= 0)
+                ForceList[j][k] = drCenter_Atom_Vec[j][k] * df_dr[j];
+            else if (AtomDragged == -1)
             {
-                for (int k = 0; k < 3; k++)
+                for (int n = 0; n < NAtoms; n++)
                 {
-                    if (AtomDragged >= 0)
-                        ForceList[j][k] = drCenter_Atom_Vec[j][k] * df_dr[j];
-                    else if (AtomDragged == -1)
-                    {
-                        for (int n = 0; n < NAtoms; n++)
-                        {
-                            ForceList[j * NAtoms + n][k] = drCenter_Atom_Vec[j * NAtoms + n][k] * df_dr[j];
-                        }
-                    }
+                    ForceList[j * NAtoms + n][k] = drCenter_Atom_Vec[j * NAtoms + n][k] * df_dr[j];
                 }
             }
-            for (int j = QMSize; j < QMSize + MMSize; j++)
+        }
+    }
+    for (int j = QMSize; j < QMSize + MMSize; j++)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            if (AtomDragged >= 0)
+                ForceList[j][k] = drCenter_Atom_Vec[j][k] * df_dr[j];
+            else if (AtomDragged == -1)
             {
-                for (int k = 0; k < 3; k++)
+                for (int n = 0; n < NAtoms; n++)
                 {
-                    if (AtomDragged >= 0)
-                        ForceList[j][k] = drCenter_Atom_Vec[j][k] * df_dr[j];
-                    else if (AtomDragged == -1)
-                    {
-                        for (int n = 0; n < NAtoms; n++)
-                        {
-                            ForceList[j * NAtoms + n][k] = drCenter_Atom_Vec[j * NAtoms + n][k] * df_dr[j];
-                        }
-                    }
+                    ForceList[j * NAtoms + n][k] = drCenter_Atom_Vec[j * NAtoms + n][k] * df_dr[j];
                 }
             }
-            TestNumeDeno(EnableValOutput, NumeVal, hList_re, AlphaNow, gamma, ScaleFactor, QMSize, MMSize, dNume_dr, dDen_dr, DenNow, DenLast, ForceList);
-
-            // Add energy to system
-            double Coe = 1.3807e-23 * T * 6.02214179e+23 / 1000.0; // kB*T, but with the unit of kJ/mol, so it's actually R*T
-            Energy += -Coe * log(NumeVal / DenVal);
-            double EnergyConvert = 1000.0 / (4.35974381e-18 * 6.02214179e+23);          // kJ/mol to Hartree
-            double UnitConvert = EnergyConvert * 0.052917724924 / (1822.8884855409500); // AUtoAMU
-            // Apply force
-            for (int j = 0; j < QMSize + MMSize; j++)
+        }
+    }
+    TestNumeDeno(EnableValOutput, NumeVal, hList_re, AlphaNow, gamma, ScaleFactor, QMSize, MMSize, dNume_dr, dDen_dr, DenNow, DenLast, ForceList);
+
+    // Add energy to system
+    double Coe = 1.3807e-23 * T * 6.02214179e+23 / 1000.0; // kB*T, but with the unit of kJ/mol, so it's actually R*T
+    double EnergyConvert = 1000.0 / (4.35974381e-18 * 6.02214179e+23);          // kJ/mol to Hartree
+    double UnitConvert = EnergyConvert * 0.052917724924 / (1822.8884855409500); // AUtoAMU
+    // Force on every atom of the group, by its place in the topology
+    const GroupTopology &Group = Topology[iGroup];
+    vector<Vec3> &GroupForce = S.GroupForce;
+    GroupForce.assign(Group.Atoms.size(), Vec3(0.0, 0.0, 0.0));
+    for (int j = 0; j < QMSize + MMSize; j++)
+    {
+        const int first = Group.Start[j];
+        for (int k = 0; k < 3; k++)
+        {
+            if (AtomDragged >= 0)
+                GroupForce[first + AtomDragged][k] = Coe * ForceList[j][k];
+            else if (AtomDragged == -1)
             {
-                for (int k = 0; k < 3; k++)
-                {
-                    if (j < QMSize)
-                    {
-                        if (AtomDragged >= 0)
-                        {
-                            int realIndex = QMGroups[i][j].Indices[AtomDragged];
-                            Force[realIndex][k] += Coe * ForceList[j][k];
-                        }
-                        else if (AtomDragged == -1)
-                        {
-                            for (int n = 0; n < QMGroups[i][j].Indices.size(); n++)
-                            {
-                                int realIndex = QMGroups[i][j].Indices[n];
-                                Force[realIndex][k] += Coe * ForceList[j * NAtoms + n][k];
-                            }
-                        }
-                    }
-                    else
-                    {
-                        if (AtomDragged >= 0)
-                        {
-                            int realIndex = MMGroups[i][j - QMSize].Indices[AtomDragged];
-                            Force[realIndex][k] += Coe * ForceList[j][k];
-                        }
-                        else if (AtomDragged == -1)
-                        {
-                            for (int n = 0; n < MMGroups[i][j - QMSize].Indices.size(); n++)
-                            {
-                                int realIndex = MMGroups[i][j - QMSize].Indices[n];
-                                Force[realIndex][k] += Coe * ForceList[j * NAtoms + n][k];
-                            }
-                        }
-                    }
-                }
+                for (int n = 0; n < Group.Start[j + 1] - first; n++)
+                    GroupForce[first + n][k] = Coe * ForceList[j * NAtoms + n][k];
+            }
+        }
+    }
+    // Get the COM force, it is spread over every atom with the forces of the group
+    Vec3 &fCOM = S.COMForce;
+    fCOM = Vec3(0.0, 0.0, 0.0);
+    if (BoundaryShape == 0 || BoundaryShape == 2)
+    {
+        for (int j = 0; j < ForceList.size(); j++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                fCOM[k] += Coe * ForceList[j][k];
             }
-            // Get the COM force and apply it
-            if (BoundaryShape == 0 || BoundaryShape == 2)
+        }
+        for (int j = 0; j < 3; j++)
+            fCOM[j] *= -1.0;
+    }
+    return -Coe * log(NumeVal / DenVal);
+}
+
+double ReferenceCalcFlexiBLEForceKernel::execute(ContextImpl &context, bool includeForces, bool includeEnergy)
+{
+    /*In this function, all objects that uses the rearranged index by distance from
+     *center to the atom will contain an extension "_re".
+     */
+    return CalcForces(extractPositions(context), extractForces(context));
+}
+
+double ReferenceCalcFlexiBLEForceKernel::CalcForces(const vector<Vec3> &Positions, vector<Vec3> &Force)
+{
+    double Energy = 0.0;
+    // Shared by every group
+    if (BoundaryShape == 0 || BoundaryShape == 2)
+        Calc_SystemCOM(Positions);
+    if (DraggedAtoms.empty())
+        SelectDraggedAtoms(Positions);
+    int NumGroups = (int)QMGroups.size();
+    // Every group has its scratch before any of them runs
+    int NumActive = 0;
+    for (int i = 0; i < NumGroups; i++)
+    {
+        StepScratch &S = GetScratch(i);
+        S.Error = nullptr;
+        S.LastIteration = false;
+        if (QMGroups[i].size() != 0 && MMGroups[i].size() != 0)
+            NumActive++;
+    }
+    // Groups only share the forces, which are added up below in group order whichever thread evaluated them.
+    // The files written for testing are kept in order by evaluating one group at a time.
+    if (Pool && NumActive > 1 && EnableTestOutput == 0 && EnableValOutput == 0)
+    {
+        std::atomic<int> NextGroup(0);
+        GroupsInParallel = true;
+        Pool->execute([&](ThreadPool &pool, int threadIndex)
+                      {
+            for (int i = NextGroup++; i < NumGroups; i = NextGroup++)
             {
-                vector<double> fCOM = {0.0, 0.0, 0.0};
-                for (int j = 0; j < ForceList.size(); j++)
+                StepScratch &S = *Scratch[i];
+                if (QMGroups[i].size() == 0 || MMGroups[i].size() == 0)
+                    continue;
+                try
                 {
-                    for (int k = 0; k < 3; k++)
-                    {
-                        fCOM[k] += Coe * ForceList[j][k];
-                    }
+                    S.Energy = ExecuteGroup(i, Positions, S);
                 }
-                for (int j = 0; j < 3; j++)
-                    fCOM[j] *= -1.0;
-
-                for (int iG = 0; iG < QMGroups.size(); iG++)
+                catch (...)
                 {
-                    for (int j = 0; j < QMGroups[iG].size(); j++)
-                    {
-                        for (int k = 0; k < 3; k++)
-                        {
-                            for (int n = 0; n < QMGroups[iG][j].Indices.size(); n++)
-                            {
-                                int realIndex = QMGroups[iG][j].Indices[n];
-                                double atomMass = QMGroups[iG][j].AtomMasses[n];
-                                Force[realIndex][k] += fCOM[k] * atomMass / SystemTotalMass;
-                            }
-                        }
-                    }
+                    S.Error = std::current_exception();
                 }
-                for (int iG = 0; iG < MMGroups.size(); iG++)
+            } });
+        Pool->waitForThreads();
+        GroupsInParallel = false;
+    }
+    else
+    {
+        for (int i = 0; i < NumGroups; i++)
+        {
+            StepScratch &S = *Scratch[i];
+            if (QMGroups[i].size() == 0 || MMGroups[i].size() == 0)
+                continue;
+            try
+            {
+                S.Energy = ExecuteGroup(i, Positions, S);
+            }
+            catch (...)
+            {
+                S.Error = std::current_exception();
+                break;
+            }
+        }
+    }
+    // The positions of a step that took every threshold iteration are kept for inspection. They are written
+    // here, once, since the groups may have run on several threads, and before a group that failed to
+    // converge throws.
+    for (int i = 0; i < NumGroups; i++)
+    {
+        if (Scratch[i]->LastIteration)
+        {
+            fstream coorOut("LastCoor.txt", ios::out);
+            for (int k = 0; k < Positions.size(); k++)
+            {
+                coorOut << fixed << setprecision(10) << Positions[k][0] << " " << Positions[k][1] << " " << Positions[k][2] << endl;
+            }
+            break;
+        }
+    }
+    for (int i = 0; i < NumGroups; i++)
+    {
+        if (Scratch[i]->Error)
+            std::rethrow_exception(Scratch[i]->Error);
+    }
+    for (int i = 0; i < NumGroups; i++)
+    {
+        if (QMGroups[i].size() == 0 || MMGroups[i].size() == 0)
+            continue;
+        const StepScratch &S = *Scratch[i];
+        Energy += S.Energy;
+        // Apply force
+        const GroupTopology &Group = Topology[i];
+        for (int n = 0; n < Group.Atoms.size(); n++)
+        {
+            for (int k = 0; k < 3; k++)
+                Force[Group.Atoms[n]][k] += S.GroupForce[n][k];
+        }
+        if (BoundaryShape == 0 || BoundaryShape == 2)
+        {
+            for (const GroupTopology &Other : Topology)
+            {
+                for (int n = 0; n < Other.Atoms.size(); n++)
                 {
-                    for (int j = 0; j < MMGroups[iG].size(); j++)
-                    {
-                        for (int k = 0; k < 3; k++)
-                        {
-                            for (int n = 0; n < MMGroups[iG][j].Indices.size(); n++)
-                            {
-                                int realIndex = MMGroups[iG][j].Indices[n];
-                                double atomMass = MMGroups[iG][j].AtomMasses[n];
-                                Force[realIndex][k] += fCOM[k] * atomMass / SystemTotalMass;
-                            }
-                        }
-                    }
+                    for (int k = 0; k < 3; k++)
+                        Force[Other.Atoms[n]][k] += S.COMForce[k] * Other.SystemWeights[n];
                 }
             }
         }
@@ -1245,4 +1736,11 @@ double ReferenceCalcFlexiBLEForceKernel::execute(ContextImpl &context, bool incl
 void ReferenceCalcFlexiBLEForceKernel::copyParametersToContext(ContextImpl &context, const FlexiBLEForce &force)
 {
     string status("It's empty for now");
+}
+
+void ReferenceCalcFlexiBLEForceKernel::UseThreadPool(ThreadPool &Threads)
+{
+    OwnedPool.reset();
+    Pool = &Threads;
+    NumThreads = Pool->getNumThreads();
 }
\ No newline at end of file
@@ -0,0 +1,335 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "ReferenceFlexiBLEPairKernel.h"
+#include "openmm/OpenMMException.h"
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+// The vector paths are compiled for their instruction set function by function and only called after the
+// processor was checked, so the library itself keeps running on any x86-64
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define FLEXIBLE_PAIR_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+static inline void EvalPair(double alpha, double R, double *Val, double *Der)
+{
+    double val = 0.0, der = 0.0;
+    if (R > 0)
+    {
+        double aR = alpha * R;
+        double aRsq = aR * aR;
+        double aRcub = aRsq * aR;
+        val = aRcub / (1.0 + aR);
+        der = 3.0 * (alpha * aRsq) / (1.0 + aR) - alpha * aRcub / (aRsq + 2.0 * aR + 1.0);
+    }
+    *Val = val;
+    *Der = der;
+}
+
+static void EvalRowScalar(double alpha, double r, const double *rOther, int n, double *Val, double *Der)
+{
+    for (int k = 0; k < n; k++)
+        EvalPair(alpha, r - rOther[k], Val + k, Der + k);
+}
+
+#ifdef FLEXIBLE_PAIR_KERNEL_X86
+
+__attribute__((target("sse2"))) static void EvalRowSSE2(double alpha, double r, const double *rOther, int n, double *Val, double *Der)
+{
+    const __m128d va = _mm_set1_pd(alpha), vr = _mm_set1_pd(r), zero = _mm_setzero_pd();
+    const __m128d one = _mm_set1_pd(1.0), two = _mm_set1_pd(2.0), three = _mm_set1_pd(3.0);
+    int k = 0;
+    for (; k + 2 <= n; k += 2)
+    {
+        const __m128d R = _mm_sub_pd(vr, _mm_loadu_pd(rOther + k));
+        // Lanes with R <= 0 may divide by zero, they are cleared afterwards
+        const __m128d mask = _mm_cmpgt_pd(R, zero);
+        const __m128d aR = _mm_mul_pd(va, R);
+        const __m128d aRsq = _mm_mul_pd(aR, aR);
+        const __m128d aRcub = _mm_mul_pd(aRsq, aR);
+        const __m128d den = _mm_add_pd(one, aR);
+        const __m128d val = _mm_div_pd(aRcub, den);
+        const __m128d der = _mm_sub_pd(_mm_div_pd(_mm_mul_pd(three, _mm_mul_pd(va, aRsq)), den),
+                                 _mm_div_pd(_mm_mul_pd(va, aRcub), _mm_add_pd(_mm_add_pd(aRsq, _mm_mul_pd(two, aR)), one)));
+        _mm_storeu_pd(Val + k, _mm_and_pd(mask, val));
+        _mm_storeu_pd(Der + k, _mm_and_pd(mask, der));
+    }
+    EvalRowScalar(alpha, r, rOther + k, n - k, Val + k, Der + k);
+}
+
+__attribute__((target("avx2"))) static void EvalRowAVX2(double alpha, double r, const double *rOther, int n, double *Val, double *Der)
+{
+    const __m256d va = _mm256_set1_pd(alpha), vr = _mm256_set1_pd(r), zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0), three = _mm256_set1_pd(3.0);
+    int k = 0;
+    for (; k + 4 <= n; k += 4)
+    {
+        const __m256d R = _mm256_sub_pd(vr, _mm256_loadu_pd(rOther + k));
+        const __m256d mask = _mm256_cmp_pd(R, zero, _CMP_GT_OQ);
+        const __m256d aR = _mm256_mul_pd(va, R);
+        const __m256d aRsq = _mm256_mul_pd(aR, aR);
+        const __m256d aRcub = _mm256_mul_pd(aRsq, aR);
+        const __m256d den = _mm256_add_pd(one, aR);
+        const __m256d val = _mm256_div_pd(aRcub, den);
+        const __m256d der = _mm256_sub_pd(_mm256_div_pd(_mm256_mul_pd(three, _mm256_mul_pd(va, aRsq)), den),
+                                    _mm256_div_pd(_mm256_mul_pd(va, aRcub), _mm256_add_pd(_mm256_add_pd(aRsq, _mm256_mul_pd(two, aR)), one)));
+        _mm256_storeu_pd(Val + k, _mm256_and_pd(mask, val));
+        _mm256_storeu_pd(Der + k, _mm256_and_pd(mask, der));
+    }
+    EvalRowSSE2(alpha, r, rOther + k, n - k, Val + k, Der + k);
+}
+
+__attribute__((target("avx512f"))) static void EvalRowAVX512(double alpha, double r, const double *rOther, int n, double *Val, double *Der)
+{
+    const __m512d va = _mm512_set1_pd(alpha), vr = _mm512_set1_pd(r), zero = _mm512_setzero_pd();
+    const __m512d one = _mm512_set1_pd(1.0), two = _mm512_set1_pd(2.0), three = _mm512_set1_pd(3.0);
+    int k = 0;
+    for (; k + 8 <= n; k += 8)
+    {
+        const __m512d R = _mm512_sub_pd(vr, _mm512_loadu_pd(rOther + k));
+        const __mmask8 mask = _mm512_cmp_pd_mask(R, zero, _CMP_GT_OQ);
+        const __m512d aR = _mm512_mul_pd(va, R);
+        const __m512d aRsq = _mm512_mul_pd(aR, aR);
+        const __m512d aRcub = _mm512_mul_pd(aRsq, aR);
+        const __m512d den = _mm512_add_pd(one, aR);
+        const __m512d val = _mm512_maskz_div_pd(mask, aRcub, den);
+        const __m512d der = _mm512_maskz_sub_pd(mask, _mm512_div_pd(_mm512_mul_pd(three, _mm512_mul_pd(va, aRsq)), den),
+                                                _mm512_div_pd(_mm512_mul_pd(va, aRcub), _mm512_add_pd(_mm512_add_pd(aRsq, _mm512_mul_pd(two, aR)), one)));
+        _mm512_storeu_pd(Val + k, val);
+        _mm512_storeu_pd(Der + k, der);
+    }
+    EvalRowAVX2(alpha, r, rOther + k, n - k, Val + k, Der + k);
+}
+
+#endif
+
+bool PairKernel::IsSupported(Isa Target)
+{
+    switch (Target)
+    {
+    case Scalar:
+        return true;
+#ifdef FLEXIBLE_PAIR_KERNEL_X86
+    case SSE2:
+        return __builtin_cpu_supports("sse2");
+    case AVX2:
+        return __builtin_cpu_supports("avx2");
+    case AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+PairKernel::Isa PairKernel::Detect()
+{
+    const Isa widest[] = {AVX512, AVX2, SSE2};
+    for (Isa target : widest)
+    {
+        if (IsSupported(target))
+            return target;
+    }
+    return Scalar;
+}
+
+const char *PairKernel::Name(Isa Target)
+{
+    switch (Target)
+    {
+    case SSE2:
+        return "SSE2";
+    case AVX2:
+        return "AVX2";
+    case AVX512:
+        return "AVX-512";
+    default:
+        return "scalar";
+    }
+}
+
+void PairKernel::EvalRow(Isa Target, double alpha, double r, const double *rOther, int n, double *Val, double *Der)
+{
+    switch (Target)
+    {
+#ifdef FLEXIBLE_PAIR_KERNEL_X86
+    case AVX512:
+        EvalRowAVX512(alpha, r, rOther, n, Val, Der);
+        break;
+    case AVX2:
+        EvalRowAVX2(alpha, r, rOther, n, Val, Der);
+        break;
+    case SSE2:
+        EvalRowSSE2(alpha, r, rOther, n, Val, Der);
+        break;
+#endif
+    default:
+        EvalRowScalar(alpha, r, rOther, n, Val, Der);
+        break;
+    }
+}
+
+// Cubic Hermite interpolant over one interval of width Step as c[0] + c[1] t + c[2] t^2 + c[3] t^3, t in [0, 1]
+static inline void Hermite(double f0, double m0, double f1, double m1, double Step, double Scale, double *c)
+{
+    c[0] = Scale * f0;
+    c[1] = Scale * Step * m0;
+    c[2] = Scale * (3.0 * (f1 - f0) - Step * (2.0 * m0 + m1));
+    c[3] = Scale * (2.0 * (f0 - f1) + Step * (m0 + m1));
+}
+
+static void EvalTableScalar(const double *Coeffs, int Intervals, double Alpha, double XMax, double InvStep, double r, const double *rOther, int n, double *Val, double *Der)
+{
+    for (int k = 0; k < n; k++)
+    {
+        const double R = r - rOther[k];
+        const double x = Alpha * R;
+        if (R <= 0.0 || x >= XMax)
+        {
+            EvalPair(Alpha, R, Val + k, Der + k);
+            continue;
+        }
+        const double u = x * InvStep;
+        const int i = std::min((int)u, Intervals - 1);
+        const double t = u - i;
+        const double *c = Coeffs + 8 * (size_t)i;
+        Val[k] = c[0] + t * (c[1] + t * (c[2] + t * c[3]));
+        Der[k] = c[4] + t * (c[5] + t * (c[6] + t * c[7]));
+    }
+}
+
+#ifdef FLEXIBLE_PAIR_KERNEL_X86
+
+// Four 4 x 4 blocks, one row per lane, turned into one vector per coefficient
+__attribute__((target("avx2"))) static inline void Transpose(__m256d &c0, __m256d &c1, __m256d &c2, __m256d &c3)
+{
+    const __m256d t0 = _mm256_unpacklo_pd(c0, c1), t1 = _mm256_unpackhi_pd(c0, c1);
+    const __m256d t2 = _mm256_unpacklo_pd(c2, c3), t3 = _mm256_unpackhi_pd(c2, c3);
+    c0 = _mm256_permute2f128_pd(t0, t2, 0x20);
+    c1 = _mm256_permute2f128_pd(t1, t3, 0x20);
+    c2 = _mm256_permute2f128_pd(t0, t2, 0x31);
+    c3 = _mm256_permute2f128_pd(t1, t3, 0x31);
+}
+
+// Four pairs at a time, each lane loading the line of its interval. Groups with a pair outside of the table go
+// through the scalar path whole, so every pair gets exactly the result it gets there.
+__attribute__((target("avx2"))) static void EvalTableAVX2(const double *Coeffs, int Intervals, double Alpha, double XMax, double InvStep, double r, const double *rOther, int n, double *Val, double *Der)
+{
+    const __m256d va = _mm256_set1_pd(Alpha), vr = _mm256_set1_pd(r), zero = _mm256_setzero_pd();
+    const __m256d vmax = _mm256_set1_pd(XMax), vinv = _mm256_set1_pd(InvStep);
+    const __m128i last = _mm_set1_epi32(Intervals - 1);
+    int k = 0;
+    for (; k + 4 <= n; k += 4)
+    {
+        const __m256d R = _mm256_sub_pd(vr, _mm256_loadu_pd(rOther + k));
+        const __m256d x = _mm256_mul_pd(va, R);
+        const __m256d inside = _mm256_and_pd(_mm256_cmp_pd(R, zero, _CMP_GT_OQ), _mm256_cmp_pd(x, vmax, _CMP_LT_OQ));
+        if (_mm256_movemask_pd(inside) != 0xF)
+        {
+            EvalTableScalar(Coeffs, Intervals, Alpha, XMax, InvStep, r, rOther + k, 4, Val + k, Der + k);
+            continue;
+        }
+        const __m256d u = _mm256_mul_pd(x, vinv);
+        const __m128i i = _mm_min_epi32(_mm256_cvttpd_epi32(u), last);
+        const __m256d t = _mm256_sub_pd(u, _mm256_cvtepi32_pd(i));
+        const double *c[4] = {Coeffs + 8 * (size_t)_mm_extract_epi32(i, 0), Coeffs + 8 * (size_t)_mm_extract_epi32(i, 1),
+                              Coeffs + 8 * (size_t)_mm_extract_epi32(i, 2), Coeffs + 8 * (size_t)_mm_extract_epi32(i, 3)};
+        __m256d v0 = _mm256_loadu_pd(c[0]), v1 = _mm256_loadu_pd(c[1]), v2 = _mm256_loadu_pd(c[2]), v3 = _mm256_loadu_pd(c[3]);
+        __m256d d0 = _mm256_loadu_pd(c[0] + 4), d1 = _mm256_loadu_pd(c[1] + 4), d2 = _mm256_loadu_pd(c[2] + 4), d3 = _mm256_loadu_pd(c[3] + 4);
+        Transpose(v0, v1, v2, v3);
+        Transpose(d0, d1, d2, d3);
+        const __m256d val = _mm256_add_pd(v0, _mm256_mul_pd(t, _mm256_add_pd(v1, _mm256_mul_pd(t, _mm256_add_pd(v2, _mm256_mul_pd(t, v3))))));
+        const __m256d der = _mm256_add_pd(d0, _mm256_mul_pd(t, _mm256_add_pd(d1, _mm256_mul_pd(t, _mm256_add_pd(d2, _mm256_mul_pd(t, d3))))));
+        _mm256_storeu_pd(Val + k, val);
+        _mm256_storeu_pd(Der + k, der);
+    }
+    EvalTableScalar(Coeffs, Intervals, Alpha, XMax, InvStep, r, rOther + k, n - k, Val + k, Der + k);
+}
+
+#endif
+
+void PairTable::Fill()
+{
+    Step = XMax / Intervals;
+    InvStep = Intervals / XMax;
+    Coeffs.resize(8 * (size_t)Intervals);
+    double f0 = 0.0, d0 = 0.0, s0 = 0.0;
+    for (int i = 0; i < Intervals; i++)
+    {
+        const double x = (i + 1) * Step, x1 = 1.0 + x;
+        const double f1 = x * x * x / x1;
+        const double d1 = (2.0 * x + 3.0) * x * x / (x1 * x1);
+        const double s1 = 2.0 * x * (x * x + 3.0 * x + 3.0) / (x1 * x1 * x1);
+        Hermite(f0, d0, f1, d1, Step, 1.0, &Coeffs[8 * (size_t)i]);
+        Hermite(d0, s0, d1, s1, Step, Alpha, &Coeffs[8 * (size_t)i + 4]);
+        f0 = f1;
+        d0 = d1;
+        s0 = s1;
+    }
+}
+
+void PairTable::Build(double alpha, double RMax, double Tolerance, int MaxIntervals)
+{
+    if (alpha <= 0.0 || RMax <= 0.0 || Tolerance <= 0.0 || MaxIntervals <= 0)
+        throw OpenMMException("FlexiBLE: The pair table needs a positive alpha, range, tolerance and grid size");
+    Alpha = alpha;
+    XMax = alpha * RMax;
+    // The interpolation error of f' is below 0.32 Step^4, start from there
+    Intervals = (int)std::min((double)MaxIntervals, std::max(16.0, std::ceil(XMax / std::pow(Tolerance / 0.32, 0.25))));
+    while (true)
+    {
+        Fill();
+        Error = 0.0;
+        const double Origin = 0.0;
+        for (int i = 0; i < Intervals; i++)
+        {
+            for (int q = 1; q <= 3; q++)
+            {
+                double val = 0.0, der = 0.0;
+                const double R = (i + 0.25 * q) * Step / alpha;
+                EvalRow(PairKernel::Scalar, R, &Origin, 1, &val, &der);
+                double expectVal = 0.0, expectDer = 0.0;
+                EvalPair(alpha, R, &expectVal, &expectDer);
+                Error = std::max(Error, std::fabs(val - expectVal) / std::max(1.0, std::fabs(expectVal)));
+                Error = std::max(Error, std::fabs(der - expectDer) / std::max(alpha, std::fabs(expectDer)));
+            }
+        }
+        if (Error <= Tolerance)
+            return;
+        if (Intervals >= MaxIntervals)
+        {
+            std::stringstream msg;
+            msg << "FlexiBLE: The pair table cannot reach a tolerance of " << Tolerance << ", the finest grid is off by " << Error;
+            throw OpenMMException(msg.str());
+        }
+        Intervals = std::min(2 * Intervals, MaxIntervals);
+    }
+}
+
+void PairTable::EvalRow(PairKernel::Isa Target, double r, const double *rOther, int n, double *Val, double *Der) const
+{
+    switch (Target)
+    {
+#ifdef FLEXIBLE_PAIR_KERNEL_X86
+    case PairKernel::AVX512:
+    case PairKernel::AVX2:
+        EvalTableAVX2(Coeffs.data(), Intervals, Alpha, XMax, InvStep, r, rOther, n, Val, Der);
+        break;
+#endif
+    default:
+        EvalTableScalar(Coeffs.data(), Intervals, Alpha, XMax, InvStep, r, rOther, n, Val, Der);
+        break;
+    }
+}
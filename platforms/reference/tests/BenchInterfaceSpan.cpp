@@ -0,0 +1,127 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "ReferenceFlexiBLEPairKernel.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "FlexiBLEPairTables.h"
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+typedef ReferenceCalcFlexiBLEForceKernel::PairBand PairBand;
+
+/**
+ * Times the band of a whole layer against the band of its interface span, both dropping the pairs beyond the
+ * underflow cutoff, so the timings only differ by the ranks left out of the span. The pair table, h^QM and
+ * h^MM and a numerator are worked out as execute() does, and molecules outside of the span must come out
+ * with a zero h value. The sizes can be given on the command line. It is not run by ctest.
+ */
+
+double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// Fill the band and work out h^QM, h^MM and the numerator of seq from it, returns the time taken
+double evaluateBand(ReferenceCalcFlexiBLEForceKernel &kernel, PairKernel::Isa Target, double alpha, const vector<pair<int, double>> &rC_Atom, int QMSize, int Begin, int Count, const vector<int> &seq, vector<double> &hList, vector<double> &DerList, double &Nume, size_t &Pairs)
+{
+    const int N = (int)rC_Atom.size();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    PairBand band;
+    band.Layout(rC_Atom, Begin, Count, ReferenceCalcFlexiBLEForceKernel::UnderflowCutoff(alpha));
+    for (int a = 0; a < band.Size; a++)
+    {
+        const int lo = band.Lo[a];
+        if (lo < a)
+            PairKernel::EvalRow(Target, alpha, band.R[a], &band.R[lo], a - lo, &band.PairVal[band.Index(a, lo)], &band.PairDer[band.Index(a, lo)]);
+    }
+    band.Accumulate();
+    hList.assign(N, 0.0);
+    const int Interface = QMSize - band.First;
+    for (int p = max(band.First, 0); p < QMSize; p++)
+        hList[p] = exp(-band.ColVal(p - band.First, p - band.First + 1, Interface + 1));
+    for (int q = QMSize; q < band.First + band.Size; q++)
+        hList[q] = exp(-band.RowVal(q - band.First, Interface - 1, q - band.First));
+    DerList.assign(N, 0.0);
+    Nume = kernel.CalcPenalFunc(seq, QMSize, band, DerList, rC_Atom, 1e-8, 0);
+    Pairs = band.PairVal.size();
+    return elapsed(start);
+}
+
+void benchmarkLayer(ReferenceCalcFlexiBLEForceKernel &kernel, int N, PairKernel::Isa Target)
+{
+    const double alpha = 50.0;
+    const int QMSize = N / 10;
+    vector<pair<int, double>> rC_Atom;
+    buildSphereLayer(N, rC_Atom);
+    // The two interface molecules on the wrong sides
+    vector<int> seq(N);
+    for (int j = 0; j < N; j++)
+        seq[j] = j;
+    swap(seq[QMSize - 1], seq[QMSize]);
+
+    vector<double> hLayer, hSpan, DerLayer, DerSpan;
+    double NumeLayer, NumeSpan;
+    size_t PairsLayer, PairsSpan;
+    const double LayerTime = evaluateBand(kernel, Target, alpha, rC_Atom, QMSize, 0, N, seq, hLayer, DerLayer, NumeLayer, PairsLayer);
+    cout << N << " molecules, band of the layer with " << PairsLayer << " pairs: " << LayerTime << " ms" << endl;
+    int Begin = 0, Count = 0;
+    PairBand::InterfaceSpan(rC_Atom, QMSize, ReferenceCalcFlexiBLEForceKernel::UnderflowCutoff(alpha), Begin, Count);
+    const double SpanTime = evaluateBand(kernel, Target, alpha, rC_Atom, QMSize, Begin, Count, seq, hSpan, DerSpan, NumeSpan, PairsSpan);
+    cout << N << " molecules, band of the " << Count << " ranks of the interface span with " << PairsSpan << " pairs: " << SpanTime << " ms" << endl;
+
+    for (int j = 0; j < N; j++)
+    {
+        ASSERT_EQUAL_TOL(hLayer[j], hSpan[j], 1e-10);
+        if (j < Begin || j >= Begin + Count)
+            ASSERT_EQUAL(0.0, hLayer[j]);
+    }
+    ASSERT(NumeLayer > 0.0);
+    ASSERT_EQUAL_TOL(NumeLayer, NumeSpan, 1e-10);
+    for (int j = 0; j < N; j++)
+        ASSERT_EQUAL_TOL(DerLayer[j], DerSpan[j], 1e-10);
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        Platform &platform = Platform::getPlatformByName("Reference");
+        ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+        const PairKernel::Isa Target = PairKernel::Detect();
+        cout << "Pair rows evaluated with " << PairKernel::Name(Target) << endl;
+        vector<int> sizes = {1000, 5000, 20000};
+        if (argc > 1)
+        {
+            sizes.clear();
+            for (int i = 1; i < argc; i++)
+                sizes.push_back(atoi(argv[i]));
+        }
+        for (int N : sizes)
+            benchmarkLayer(kernel, N, Target);
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
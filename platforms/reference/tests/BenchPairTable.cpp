@@ -0,0 +1,167 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "FlexiBLEPairTables.h"
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+typedef ReferenceCalcFlexiBLEForceKernel::PairBand PairBand;
+
+/**
+ * Times the dense pair table indexed by molecule against the rank ordered band on the same pairs: every pair
+ * of the layer, with no cutoff and no interface span. Both are filled with the same scalar pair function and
+ * h^QM and h^MM are summed over the same pairs, so those timings only differ by the layout. The numerator is
+ * the one execute() works out from each: the band sums it over runs of ranks from its cumulative sums, whose
+ * cost is part of its fill. The dense table of 20000 molecules takes 6.4 GB and the band with its sums
+ * 9.6 GB, the sizes can be given on the command line. It is not run by ctest.
+ */
+
+double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+struct Timings
+{
+    double Fill, hList, Numerator;
+};
+
+void report(int N, const char *Layout, double MB, const Timings &t)
+{
+    cout << N << " molecules, " << Layout << " (" << MB << " MB): fill " << t.Fill << " ms, h lists " << t.hList << " ms, numerator " << t.Numerator << " ms" << endl;
+}
+
+void benchmarkLayer(ReferenceCalcFlexiBLEForceKernel &kernel, int N)
+{
+    const double alpha = 50.0;
+    const int QMSize = N / 10;
+    vector<pair<int, double>> rC_Atom;
+    buildSphereLayer(N, rC_Atom);
+    // The two interface molecules on the wrong sides
+    vector<int> seq(N);
+    for (int j = 0; j < N; j++)
+        seq[j] = j;
+    swap(seq[QMSize - 1], seq[QMSize]);
+    vector<double> hDense(N, 0.0), hBand(N, 0.0), DerDense(N, 0.0), DerBand(N, 0.0);
+    double NumeDense, NumeBand;
+
+    // Each table is freed before the other one is built
+    {
+        Timings t;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        vector<vector<gInfo>> g(N, vector<gInfo>(N, gInfo{0.0, 0.0}));
+        for (int a = 0; a < N; a++)
+        {
+            gInfo *row = g[rC_Atom[a].first].data();
+            for (int c = 0; c < a; c++)
+                row[rC_Atom[c].first].val = kernel.CalcPairExpPart(alpha, rC_Atom[a].second - rC_Atom[c].second, row[rC_Atom[c].first].der);
+        }
+        t.Fill = elapsed(start);
+        start = chrono::steady_clock::now();
+        for (int p = 0; p < QMSize; p++)
+        {
+            double ExpPart = 0.0;
+            for (int j = p + 1; j <= QMSize; j++)
+                ExpPart += g[rC_Atom[j].first][rC_Atom[p].first].val;
+            hDense[p] = exp(-ExpPart);
+        }
+        for (int q = QMSize; q < N; q++)
+        {
+            double ExpPart = 0.0;
+            for (int j = QMSize - 1; j < q; j++)
+                ExpPart += g[rC_Atom[q].first][rC_Atom[j].first].val;
+            hDense[q] = exp(-ExpPart);
+        }
+        t.hList = elapsed(start);
+        start = chrono::steady_clock::now();
+        NumeDense = kernel.CalcPenalFunc(seq, QMSize, g, DerDense, rC_Atom, 1e-8, 0);
+        t.Numerator = elapsed(start);
+        report(N, "dense table", (double)N * N * sizeof(gInfo) / 1048576.0, t);
+    }
+    {
+        Timings t;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        PairBand band;
+        band.Layout(rC_Atom, 0, N, 0.0);
+        for (int a = 0; a < N; a++)
+        {
+            double *Val = &band.PairVal[band.Index(a, 0)], *Der = &band.PairDer[band.Index(a, 0)];
+            for (int c = 0; c < a; c++)
+                Val[c] = kernel.CalcPairExpPart(alpha, rC_Atom[a].second - rC_Atom[c].second, Der[c]);
+        }
+        band.Accumulate();
+        t.Fill = elapsed(start);
+        start = chrono::steady_clock::now();
+        for (int p = 0; p < QMSize; p++)
+        {
+            double ExpPart = 0.0;
+            for (int j = p + 1; j <= QMSize; j++)
+                ExpPart += band.PairVal[band.Index(j, p)];
+            hBand[p] = exp(-ExpPart);
+        }
+        for (int q = QMSize; q < N; q++)
+        {
+            const double *Val = &band.PairVal[band.Index(q, 0)];
+            double ExpPart = 0.0;
+            for (int j = QMSize - 1; j < q; j++)
+                ExpPart += Val[j];
+            hBand[q] = exp(-ExpPart);
+        }
+        t.hList = elapsed(start);
+        start = chrono::steady_clock::now();
+        NumeBand = kernel.CalcPenalFunc(seq, QMSize, band, DerBand, rC_Atom, 1e-8, 0);
+        t.Numerator = elapsed(start);
+        const size_t Doubles = band.PairVal.size() + band.PairDer.size() + band.RowValSum.size() + band.RowDerSum.size() + band.ColValSum.size() + band.ColDerSum.size();
+        report(N, "band", Doubles * sizeof(double) / 1048576.0, t);
+    }
+
+    for (int j = 0; j < N; j++)
+        ASSERT_EQUAL_TOL(hDense[j], hBand[j], 1e-10);
+    ASSERT(NumeDense > 0.0);
+    ASSERT_EQUAL_TOL(NumeDense, NumeBand, 1e-10);
+    for (int j = 0; j < N; j++)
+        ASSERT_EQUAL_TOL(DerDense[j], DerBand[j], 1e-10);
+}
+
+int main(int argc, char *argv[])
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        Platform &platform = Platform::getPlatformByName("Reference");
+        ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+        vector<int> sizes = {1000, 5000, 20000};
+        if (argc > 1)
+        {
+            sizes.clear();
+            for (int i = 1; i < argc; i++)
+                sizes.push_back(atoi(argv[i]));
+        }
+        for (int N : sizes)
+            benchmarkLayer(kernel, N);
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
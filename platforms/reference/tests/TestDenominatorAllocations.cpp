@@ -0,0 +1,67 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "AllocationCounter.h"
+#include "FlexiBLEPairTables.h"
+#include <iostream>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+void testDenominatorAllocations()
+{
+    registerFlexiBLEReferenceKernelFactories();
+    Platform &platform = Platform::getPlatformByName("Reference");
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+
+    const int N = 40, QMSize = 20;
+    const double h = 1e-6;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, 10.0, g, rC_Atom);
+    vector<double> DerList(N, 0.0);
+
+    // The first evaluation sizes the node table and the per-depth buffers
+    size_t before = AllocationCount;
+    double first = kernel.CalcDenominator(N, h, QMSize, 0, g, DerList, rC_Atom);
+    size_t warmup = AllocationCount - before;
+
+    // Later evaluations of the same layer reuse them
+    for (int i = 0; i < N; i++)
+        DerList[i] = 0.0;
+    before = AllocationCount;
+    double second = kernel.CalcDenominator(N, h, QMSize, 0, g, DerList, rC_Atom);
+    size_t steady = AllocationCount - before;
+
+    cout << "Denominator " << first << ", allocations in first evaluation " << warmup << ", afterwards " << steady << endl;
+    ASSERT(first > 1.0);
+    ASSERT_EQUAL_TOL(first, second, 1e-12);
+    ASSERT_EQUAL(0, (int)steady);
+}
+
+int main()
+{
+    try
+    {
+        testDenominatorAllocations();
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,316 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "FlexiBLEPairTables.h"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+// Initialize a kernel on a small neon system, only the enumeration settings matter here
+void initKernel(ReferenceCalcFlexiBLEForceKernel &kernel, int CutoffMethod, int Order, int MaxNodes, int NumThreads = 1, int Canonical = 0, int WarmStart = 0)
+{
+    System system;
+    for (int a = 0; a < 6; a++)
+        system.addParticle(20.1797);
+    FlexiBLEForce boundary;
+    boundary.SetQMIndices({2, 4});
+    boundary.SetMoleculeInfo({6, 1});
+    boundary.SetAssignedIndex({0});
+    boundary.GroupingMolecules();
+    boundary.SetInitialThre({1e-6});
+    boundary.SetFlexiBLEMaxIt({10});
+    boundary.SetScales({0.5});
+    boundary.SetAlphas({10.0});
+    boundary.SetBoundaryType(1, {{0.0, 0.0, 0.0}});
+    boundary.SetCutoffMethod(CutoffMethod);
+    boundary.SetEnumerationOrder(Order);
+    boundary.SetMaxNodes(MaxNodes);
+    boundary.SetNumThreads(NumThreads);
+    boundary.SetCanonicalParents(Canonical);
+    boundary.SetWarmStart(WarmStart);
+    kernel.initialize(system, boundary);
+}
+
+void testOrders(int CutoffMethod)
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    const int N = 40, QMSize = 20;
+    const double h = 1e-6;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, 10.0, g, rC_Atom);
+
+    // Depth first and breadth first walks sum the same terms
+    ReferenceCalcFlexiBLEForceKernel dfs(CalcFlexiBLEForceKernel::Name(), platform);
+    ReferenceCalcFlexiBLEForceKernel bfs(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(dfs, CutoffMethod, 0, 0);
+    initKernel(bfs, CutoffMethod, 1, 0);
+    vector<double> DerDFS(N, 0.0), DerBFS(N, 0.0);
+    double DenoDFS = dfs.CalcDenominator(N, h, QMSize, 0, g, DerDFS, rC_Atom);
+    double DenoBFS = bfs.CalcDenominator(N, h, QMSize, 0, g, DerBFS, rC_Atom);
+    cout << "CutoffMethod " << CutoffMethod << ": denominator " << DenoDFS << " (depth first), " << DenoBFS << " (breadth first)" << endl;
+    ASSERT(DenoDFS > 1.0);
+    ASSERT_EQUAL_TOL(DenoDFS, DenoBFS, 1e-12);
+    for (int i = 0; i < N; i++)
+        ASSERT_EQUAL_TOL(DerDFS[i], DerBFS[i], 1e-10);
+}
+
+void testParallel(int CutoffMethod, int Order)
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    const int N = 40, QMSize = 20;
+    const double h = 1e-6;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, 10.0, g, rC_Atom);
+
+    // Threads split the tree between them, the sum only changes by rounding
+    ReferenceCalcFlexiBLEForceKernel serial(CalcFlexiBLEForceKernel::Name(), platform);
+    ReferenceCalcFlexiBLEForceKernel parallel(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(serial, CutoffMethod, Order, 0);
+    initKernel(parallel, CutoffMethod, Order, 0, 4);
+    vector<double> DerSerial(N, 0.0);
+    double DenoSerial = serial.CalcDenominator(N, h, QMSize, 0, g, DerSerial, rC_Atom);
+    for (int repeat = 0; repeat < 3; repeat++)
+    {
+        vector<double> DerParallel(N, 0.0);
+        double DenoParallel = parallel.CalcDenominator(N, h, QMSize, 0, g, DerParallel, rC_Atom);
+        ASSERT_EQUAL_TOL(DenoSerial, DenoParallel, 1e-12);
+        for (int i = 0; i < N; i++)
+            ASSERT_EQUAL_TOL(DerSerial[i], DerParallel[i], 1e-10);
+    }
+
+    // The node limit holds for the threads as well
+    ReferenceCalcFlexiBLEForceKernel limited(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(limited, CutoffMethod, Order, 100, 4);
+    vector<double> DerList(N, 0.0);
+    bool thrown = false;
+    try
+    {
+        limited.CalcDenominator(N, h, QMSize, 0, g, DerList, rC_Atom);
+    }
+    catch (const OpenMMException &e)
+    {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testCanonical(int CutoffMethod, int NumThreads)
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    const int N = 40, QMSize = 20;
+    const double h = 1e-6;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, 10.0, g, rC_Atom);
+
+    // Generating every node from one parent keeps exactly the terms the visited-node table keeps
+    ReferenceCalcFlexiBLEForceKernel table(CalcFlexiBLEForceKernel::Name(), platform);
+    ReferenceCalcFlexiBLEForceKernel canonical(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(table, CutoffMethod, 0, 0);
+    initKernel(canonical, CutoffMethod, 0, 0, NumThreads, 1);
+    vector<double> DerTable(N, 0.0), DerCanonical(N, 0.0);
+    double DenoTable = table.CalcDenominator(N, h, QMSize, 0, g, DerTable, rC_Atom);
+    double DenoCanonical = canonical.CalcDenominator(N, h, QMSize, 0, g, DerCanonical, rC_Atom);
+    ASSERT_EQUAL_TOL(DenoTable, DenoCanonical, 1e-12);
+    for (int i = 0; i < N; i++)
+        ASSERT_EQUAL_TOL(DerTable[i], DerCanonical[i], 1e-10);
+}
+
+void testWarmStart(int CutoffMethod)
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    const int N = 60, QMSize = 30;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, 10.0, g, rC_Atom);
+
+    // Lower the threshold while the window grows on both sides, as the iterations in execute() do
+    const int LB[3] = {20, 15, 12}, Size[3] = {20, 32, 40};
+    const double h[3] = {1e-2, 1e-4, 1e-6};
+    ReferenceCalcFlexiBLEForceKernel cold(CalcFlexiBLEForceKernel::Name(), platform);
+    ReferenceCalcFlexiBLEForceKernel warm(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(cold, CutoffMethod, 0, 0);
+    initKernel(warm, CutoffMethod, 0, 0, 1, 0, 1);
+    for (int it = 0; it < 3; it++)
+    {
+        vector<double> DerCold(N, 0.0), DerWarm(N, 0.0);
+        double DenoCold = cold.CalcDenominator(Size[it], h[it], QMSize - LB[it], LB[it], g, DerCold, rC_Atom);
+        double DenoWarm = warm.CalcDenominatorWarm(Size[it], h[it], QMSize - LB[it], LB[it], g, DerWarm, rC_Atom, it == 0);
+        ASSERT_EQUAL_TOL(DenoCold, DenoWarm, 1e-12);
+        for (int i = 0; i < N; i++)
+            ASSERT_EQUAL_TOL(DerCold[i], DerWarm[i], 1e-10);
+    }
+}
+
+void testNodeBudget()
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    const int N = 40, QMSize = 20;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, 10.0, g, rC_Atom);
+    vector<double> DerList(N, 0.0);
+
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(kernel, 0, 0, 100);
+    bool thrown = false;
+    try
+    {
+        kernel.CalcDenominator(N, 1e-6, QMSize, 0, g, DerList, rC_Atom);
+    }
+    catch (const OpenMMException &e)
+    {
+        cout << "Expected: " << e.what() << endl;
+        thrown = true;
+    }
+    ASSERT(thrown);
+
+    // A threshold that keeps the tree under the limit still works
+    for (int i = 0; i < N; i++)
+        DerList[i] = 0.0;
+    double Deno = kernel.CalcDenominator(N, 0.5, QMSize, 0, g, DerList, rC_Atom);
+    ASSERT(Deno >= 1.0);
+}
+
+void testPairBand()
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(kernel, 0, 0, 0);
+    const int N = 50, QMSize = 25;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, 10.0, g, rC_Atom, 0.004);
+    ReferenceCalcFlexiBLEForceKernel::PairBand band;
+    band.Build(g, rC_Atom, 0, N);
+    ASSERT_EQUAL((size_t)N * (N - 1) / 2, band.PairVal.size());
+
+    // Each pair is stored once and read back in both directions
+    for (int i = 0; i < N; i++)
+    {
+        for (int j = 0; j < N; j++)
+        {
+            ASSERT_EQUAL_TOL(g[i][j].val, band.Get(i, j).val, 1e-15);
+            ASSERT_EQUAL_TOL(g[i][j].der, band.Get(i, j).der, 1e-15);
+        }
+    }
+
+    // Range queries against the plain loops over the pair table
+    for (int a = 0; a < N; a += 7)
+    {
+        for (int lo = 0; lo < N; lo += 3)
+        {
+            for (int hi = lo; hi <= N; hi += 5)
+            {
+                double row = 0.0, col = 0.0;
+                for (int c = lo; c < hi; c++)
+                {
+                    row += g[rC_Atom[a].first][rC_Atom[c].first].val;
+                    col += g[rC_Atom[c].first][rC_Atom[a].first].val;
+                }
+                ASSERT_EQUAL_TOL(row, band.RowVal(a, lo, hi), 1e-12);
+                ASSERT_EQUAL_TOL(col, band.ColVal(a, lo, hi), 1e-12);
+            }
+        }
+    }
+
+    // Penalty function of an arrangement with a few molecules across the boundary, with and without the band
+    vector<pair<int, double>> byIndex(rC_Atom);
+    sort(byIndex.begin(), byIndex.end());
+    vector<int> seq(N);
+    for (int i = 0; i < N; i++)
+        seq[i] = rC_Atom[i].first;
+    swap(seq[QMSize - 1], seq[QMSize + 1]);
+    swap(seq[QMSize - 3], seq[QMSize]);
+    vector<double> DerLoop(N, 0.0), DerBand(N, 0.0);
+    const double loop = kernel.CalcPenalFunc(seq, QMSize, g, DerLoop, byIndex, 0.0, 0);
+    const double ranked = kernel.CalcPenalFunc(seq, QMSize, band, DerBand, byIndex, 0.0, 0);
+    ASSERT(loop > 1e-6 && loop < 1.0);
+    ASSERT_EQUAL_TOL(loop, ranked, 1e-12);
+    for (int i = 0; i < N; i++)
+        ASSERT_EQUAL_TOL(DerLoop[i], DerBand[i], 1e-10);
+}
+
+void testPairCutoff(int CutoffMethod)
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(kernel, CutoffMethod, 0, 0);
+    const int N = 40, QMSize = 20;
+    const double alpha = 60.0;
+    vector<vector<gInfo>> g;
+    vector<pair<int, double>> rC_Atom;
+    buildPairTable(N, alpha, g, rC_Atom);
+
+    // Only pairs that underflow on their own are dropped, so the band gives the dense result
+    ReferenceCalcFlexiBLEForceKernel::PairBand band;
+    band.Layout(rC_Atom, 0, N, ReferenceCalcFlexiBLEForceKernel::UnderflowCutoff(alpha));
+    for (int a = 0; a < N; a++)
+    {
+        for (int c = band.Lo[a]; c < a; c++)
+        {
+            band.PairVal[band.Index(a, c)] = g[rC_Atom[a].first][rC_Atom[c].first].val;
+            band.PairDer[band.Index(a, c)] = g[rC_Atom[a].first][rC_Atom[c].first].der;
+        }
+    }
+    band.Accumulate();
+    ASSERT(band.Lo[N - 1] > 0);
+    ASSERT(band.PairVal.size() < (size_t)N * (N - 1) / 2);
+    ASSERT(std::isinf(band.RowVal(N - 1, 0, 1)));
+    ASSERT(std::isinf(band.ColVal(0, 1, N)));
+    ASSERT(std::isinf(band.Get(rC_Atom[N - 1].first, rC_Atom[0].first).val));
+    ASSERT_EQUAL(0.0, band.Get(rC_Atom[0].first, rC_Atom[N - 1].first).val);
+    ASSERT(exp(-g[rC_Atom[N - 1].first][rC_Atom[0].first].val) == 0.0);
+
+    vector<double> DerDense(N, 0.0), DerBand(N, 0.0);
+    const double dense = kernel.CalcDenominator(N, 1e-8, QMSize, 0, g, DerDense, rC_Atom);
+    const double banded = kernel.CalcDenominator(N, 1e-8, QMSize, 0, band, DerBand, rC_Atom);
+    ASSERT_EQUAL_TOL(dense, banded, 1e-12);
+    for (int i = 0; i < N; i++)
+        ASSERT_EQUAL_TOL(DerDense[i], DerBand[i], 1e-10);
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        testOrders(0);
+        testOrders(1);
+        testNodeBudget();
+        testPairBand();
+        for (int CutoffMethod = 0; CutoffMethod < 2; CutoffMethod++)
+        {
+            testParallel(CutoffMethod, 0);
+            testParallel(CutoffMethod, 1);
+            testCanonical(CutoffMethod, 1);
+            testCanonical(CutoffMethod, 4);
+            testWarmStart(CutoffMethod);
+            testPairCutoff(CutoffMethod);
+        }
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
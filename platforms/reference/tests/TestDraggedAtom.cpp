@@ -0,0 +1,92 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <iostream>
+#include <vector>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+const int NumMolecules = 3;
+
+// Masses and offsets along x of the atoms of a molecule of every group. The heaviest atom is never the one
+// closest to the centroid for its mass, except in the single atom molecule.
+const vector<vector<double>> Masses = {{15.999, 1.008, 1.008}, {15.999, 12.011, 1.008, 1.008}, {20.1797}};
+const vector<vector<double>> Offsets = {{0.0, 0.101, 0.2}, {0.0, 0.2, 0.25, 0.35}, {0.0}};
+
+// Without an assigned atom, each group drags the atom of its first molecule with the largest ratio of mass to
+// distance from the centroid, or the heavy atom sitting on the centroid. Every atom is measured at its own
+// position.
+void testDraggedAtoms()
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    System system;
+    vector<Vec3> Reference;
+    vector<int> MoleculeInfo, QMIndices;
+    int first = 0;
+    for (int g = 0; g < (int)Masses.size(); g++)
+    {
+        const int size = (int)Masses[g].size();
+        MoleculeInfo.push_back(NumMolecules);
+        MoleculeInfo.push_back(size);
+        for (int j = 0; j < NumMolecules; j++)
+        {
+            for (int a = 0; a < size; a++)
+            {
+                system.addParticle(Masses[g][a]);
+                Reference.push_back(Vec3(0.5 * j + Offsets[g][a], 0.5 * g, 0.0));
+            }
+        }
+        // The second molecule of every group is QM, it comes first in the group
+        for (int a = 0; a < size; a++)
+            QMIndices.push_back(first + size + a);
+        first += NumMolecules * size;
+    }
+    FlexiBLEForce boundary;
+    boundary.SetQMIndices(QMIndices);
+    boundary.SetMoleculeInfo(MoleculeInfo);
+    boundary.GroupingMolecules();
+    boundary.SetInitialThre({1e-6, 1e-6, 1e-6});
+    boundary.SetFlexiBLEMaxIt({10, 10, 10});
+    boundary.SetScales({0.5, 0.5, 0.5});
+    boundary.SetAlphas({10.0, 10.0, 10.0});
+    boundary.SetBoundaryType(1, {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}});
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    kernel.initialize(system, boundary);
+    kernel.SelectDraggedAtoms(Reference);
+    const vector<int> &Dragged = kernel.GetDraggedAtoms();
+    ASSERT_EQUAL(3, (int)Dragged.size());
+    // The hydrogen next to the centroid outweighs the oxygen for its distance
+    ASSERT_EQUAL(1, Dragged[0]);
+    // The carbon sits on the centroid
+    ASSERT_EQUAL(1, Dragged[1]);
+    ASSERT_EQUAL(0, Dragged[2]);
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        testDraggedAtoms();
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,156 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "AllocationCounter.h"
+#include <iostream>
+#include <cmath>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+const int NumMolecules = 12;
+
+// A layer of water-like molecules, the last three of them QM, on a kernel using the given boundary
+void initKernel(ReferenceCalcFlexiBLEForceKernel &kernel, int Shape, const vector<vector<double>> &Parameters)
+{
+    System system;
+    for (int j = 0; j < NumMolecules; j++)
+    {
+        system.addParticle(15.999);
+        system.addParticle(1.008);
+        system.addParticle(1.008);
+    }
+    FlexiBLEForce boundary;
+    boundary.SetQMIndices({27, 28, 29, 30, 31, 32, 33, 34, 35});
+    boundary.SetMoleculeInfo({NumMolecules, 3});
+    boundary.GroupingMolecules();
+    boundary.SetInitialThre({1e-6});
+    boundary.SetFlexiBLEMaxIt({10});
+    boundary.SetScales({0.5});
+    boundary.SetAlphas({10.0});
+    boundary.SetBoundaryType(Shape, Parameters);
+    kernel.initialize(system, boundary);
+}
+
+void testShape(int Shape, const vector<vector<double>> &Parameters)
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(kernel, Shape, Parameters);
+    vector<Vec3> Positions;
+    for (int j = 0; j < NumMolecules; j++)
+    {
+        const Vec3 O(0.3 * cos(j), 0.3 * sin(2.0 * j), 0.1 * j - 0.5);
+        Positions.push_back(O);
+        Positions.push_back(O + Vec3(0.0957, 0.0, 0.0));
+        Positions.push_back(O + Vec3(-0.024, 0.0927, 0.0));
+    }
+
+    vector<pair<int, double>> rCA;
+    vector<Vec3> rCA_Vec, drCA;
+    const int targets[] = {-1, 0};
+    for (int TargetAtom : targets)
+    {
+        // The first call sizes the buffers, later ones refill them in place
+        kernel.Calc_SystemCOM(Positions);
+        kernel.Calc_r(rCA, rCA_Vec, Positions, 0, TargetAtom);
+        kernel.Calc_dr(0, TargetAtom, rCA, rCA_Vec, drCA);
+        for (int step = 0; step < 3; step++)
+        {
+            for (Vec3 &p : Positions)
+                p += Vec3(0.001, -0.002, 0.0005);
+            const size_t before = AllocationCount;
+            kernel.Calc_SystemCOM(Positions);
+            kernel.Calc_r(rCA, rCA_Vec, Positions, 0, TargetAtom);
+            kernel.Calc_dr(0, TargetAtom, rCA, rCA_Vec, drCA);
+            ASSERT_EQUAL(0, (int)(AllocationCount - before));
+        }
+        ASSERT_EQUAL(NumMolecules, (int)rCA.size());
+        ASSERT_EQUAL(TargetAtom == -1 ? 3 * NumMolecules : NumMolecules, (int)drCA.size());
+        for (int j = 0; j < NumMolecules; j++)
+        {
+            ASSERT_EQUAL(j, rCA[j].first);
+            ASSERT_EQUAL_TOL(rCA[j].second, sqrt(rCA_Vec[j].dot(rCA_Vec[j])), 1e-12);
+            // The mass weights of a molecule add up to one, so its atom derivatives sum to the unit vector
+            if (TargetAtom == -1)
+            {
+                const Vec3 sum = drCA[3 * j] + drCA[3 * j + 1] + drCA[3 * j + 2];
+                for (int k = 0; k < 3; k++)
+                    ASSERT_EQUAL_TOL(rCA_Vec[j][k] / rCA[j].second, sum[k], 1e-12);
+            }
+            // QM molecules come first, around a fixed center the vector is from it to the molecule
+            if (Shape == 1)
+            {
+                const int Molecule = j < 3 ? NumMolecules - 3 + j : j - 3;
+                Vec3 expect(0.0, 0.0, 0.0);
+                double mass = 0.0;
+                for (int a = 0; a < 3; a++)
+                {
+                    const double m = a == 0 ? 15.999 : 1.008;
+                    if (TargetAtom == -1 || TargetAtom == a)
+                    {
+                        expect += Positions[3 * Molecule + a] * m;
+                        mass += m;
+                    }
+                }
+                expect = expect * (1.0 / mass) - Vec3(Parameters[0][0], Parameters[0][1], Parameters[0][2]);
+                for (int k = 0; k < 3; k++)
+                    ASSERT_EQUAL_TOL(expect[k], rCA_Vec[j][k], 1e-12);
+            }
+        }
+    }
+    cout << "Boundary shape " << Shape << " computes distances without allocating" << endl;
+}
+
+// Without an assigned atom the one closest to the centroid for its mass is chosen once, from the reference
+void testDraggedAtom()
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    initKernel(kernel, 0, {{0.0, 0.0, 0.0}});
+    ASSERT(kernel.GetDraggedAtoms().empty());
+    vector<Vec3> Reference;
+    for (int j = 0; j < NumMolecules; j++)
+    {
+        const Vec3 O(0.3 * j, 0.0, 0.0);
+        Reference.push_back(O);
+        Reference.push_back(O + Vec3(0.101, 0.0, 0.0));
+        Reference.push_back(O + Vec3(0.2, 0.0, 0.0));
+    }
+    kernel.SelectDraggedAtoms(Reference);
+    ASSERT_EQUAL(1, (int)kernel.GetDraggedAtoms().size());
+    ASSERT_EQUAL(1, kernel.GetDraggedAtoms()[0]);
+    cout << "The dragged atom is selected from the reference geometry" << endl;
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        testShape(0, {{0.0, 0.0, 0.0}});
+        testShape(1, {{0.1, -0.2, 0.0}});
+        testShape(2, {{0.0, 0.0, 0.4}});
+        testShape(3, {{0.0, 0.0, -0.3, 0.0, 0.1, 0.3}});
+        testDraggedAtom();
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
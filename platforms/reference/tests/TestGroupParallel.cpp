@@ -0,0 +1,66 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "FlexiBLETestSystems.h"
+#include <iostream>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+State evaluate(int NumThreads)
+{
+    System system;
+    vector<Vec3> positions;
+    FlexiBLEForce *boundary = new FlexiBLEForce();
+    buildSystem(system, positions, *boundary, 2, 0, {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}});
+    boundary->SetNumThreads(NumThreads);
+    system.addForce(boundary);
+    VerletIntegrator integrator(0.001);
+    Platform &platform = Platform::getPlatformByName("Reference");
+    Context context(system, integrator, platform);
+    context.setPositions(positions);
+    return context.getState(State::Forces | State::Energy);
+}
+
+// The groups evaluated on a pool add up to exactly what they give one after the other
+void testGroupsInParallel()
+{
+    const State serial = evaluate(1);
+    const State parallel = evaluate(4);
+    ASSERT_EQUAL(serial.getPotentialEnergy(), parallel.getPotentialEnergy());
+    const vector<Vec3> &expected = serial.getForces(), &found = parallel.getForces();
+    ASSERT_EQUAL(expected.size(), found.size());
+    for (int a = 0; a < expected.size(); a++)
+    {
+        for (int k = 0; k < 3; k++)
+            ASSERT_EQUAL(expected[a][k], found[a][k]);
+    }
+    cout << "Groups evaluated in parallel match the serial forces" << endl;
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        testGroupsInParallel();
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,124 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <iostream>
+#include <cmath>
+#include <vector>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+void testWindowBounds()
+{
+    const int QMSize = 3;
+    int ImpQMlb, ImpMMub;
+    // Every molecule important, the window spans the whole layer
+    ReferenceCalcFlexiBLEForceKernel::ImportantWindow({1.0, 1.0, 1.0, 1.0, 1.0}, QMSize, 0.1, ImpQMlb, ImpMMub);
+    ASSERT_EQUAL(0, ImpQMlb);
+    ASSERT_EQUAL(4, ImpMMub);
+    // Counted back from the interface, up to the first molecule below the threshold
+    ReferenceCalcFlexiBLEForceKernel::ImportantWindow({0.0, 0.5, 1.0, 1.0, 0.5, 0.0, 1.0}, QMSize, 0.1, ImpQMlb, ImpMMub);
+    ASSERT_EQUAL(1, ImpQMlb);
+    ASSERT_EQUAL(4, ImpMMub);
+    // No MM molecule important
+    ReferenceCalcFlexiBLEForceKernel::ImportantWindow({1.0, 1.0, 1.0, 0.0, 1.0}, QMSize, 0.1, ImpQMlb, ImpMMub);
+    ASSERT_EQUAL(0, ImpQMlb);
+    ASSERT_EQUAL(QMSize - 1, ImpMMub);
+}
+
+// Exponent of an arrangement of molecules in rank order, every QM one pairing with the MM ones inside of it
+double arrangementExponent(ReferenceCalcFlexiBLEForceKernel &kernel, double alpha, const vector<double> &r, const vector<int> &IsQM)
+{
+    double sumExp = 0.0, der;
+    for (int x = 0; x < (int)r.size(); x++)
+    {
+        for (int y = 0; y < x; y++)
+        {
+            if (IsQM[x] && !IsQM[y])
+                sumExp += kernel.CalcPairExpPart(alpha, r[x] - r[y], der);
+        }
+    }
+    return sumExp;
+}
+
+// A layer small and soft enough for every molecule to be important, so the energy is the one of the sum over
+// all arrangements
+void testAllImportant(int NumMolecules, const vector<int> &QMIndices)
+{
+    const double alpha = 5.0, Temperature = 300.0;
+    Platform &platform = Platform::getPlatformByName("Reference");
+    System system;
+    vector<Vec3> Positions;
+    vector<double> r;
+    for (int i = 0; i < NumMolecules; i++)
+    {
+        system.addParticle(20.1797);
+        r.push_back(0.1 * (i + 1));
+        Positions.push_back(Vec3(r[i], 0.0, 0.0));
+    }
+    FlexiBLEForce boundary;
+    boundary.SetQMIndices(QMIndices);
+    boundary.SetMoleculeInfo({NumMolecules, 1});
+    boundary.SetAssignedIndex({0});
+    boundary.GroupingMolecules();
+    boundary.SetInitialThre({1e-6});
+    boundary.SetFlexiBLEMaxIt({10});
+    boundary.SetScales({0.5});
+    boundary.SetAlphas({alpha});
+    boundary.SetBoundaryType(1, {{0.0, 0.0, 0.0}});
+    boundary.SetTemperature(Temperature);
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    kernel.initialize(system, boundary);
+    vector<Vec3> Forces(NumMolecules, Vec3());
+    const double Energy = kernel.CalcForces(Positions, Forces);
+
+    vector<int> IsQM(NumMolecules, 0);
+    for (int i : QMIndices)
+        IsQM[i] = 1;
+    const double Nume = exp(-arrangementExponent(kernel, alpha, r, IsQM));
+    double Deno = 0.0;
+    for (int mask = 0; mask < (1 << NumMolecules); mask++)
+    {
+        vector<int> Arrangement(NumMolecules);
+        int count = 0;
+        for (int i = 0; i < NumMolecules; i++)
+        {
+            Arrangement[i] = (mask >> i) & 1;
+            count += Arrangement[i];
+        }
+        if (count == (int)QMIndices.size())
+            Deno += exp(-arrangementExponent(kernel, alpha, r, Arrangement));
+    }
+    const double RT = 1.3807e-23 * Temperature * 6.02214179e+23 / 1000.0;
+    ASSERT_EQUAL_TOL(-RT * log(Nume / Deno), Energy, 1e-10);
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        testWindowBounds();
+        testAllImportant(4, {1, 3});
+        testAllImportant(5, {0, 2, 3});
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "ReferenceFlexiBLEPairKernel.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+// Every row length up to a few vector widths, so the vector loops and their scalar tails are all covered,
+// against CalcPairExpPart one pair at a time
+void testRows(ReferenceCalcFlexiBLEForceKernel &kernel, PairKernel::Isa Target)
+{
+    srand(2023);
+    const double alphas[] = {0.5, 10.0, 60.0};
+    for (double alpha : alphas)
+    {
+        for (int n = 0; n <= 35; n++)
+        {
+            const double r = 1.0;
+            vector<double> rOther(n);
+            for (int k = 0; k < n; k++)
+                rOther[k] = 2.0 * rand() / RAND_MAX;
+            // Pairs on the other side and at the same distance give 0
+            if (n > 2)
+            {
+                rOther[1] = r;
+                rOther[2] = r + 1e-3;
+            }
+            vector<double> val(n + 1, -1.0), der(n + 1, -1.0);
+            PairKernel::EvalRow(Target, alpha, r, rOther.data(), n, val.data(), der.data());
+            for (int k = 0; k < n; k++)
+            {
+                double expectDer = 0.0;
+                const double expectVal = kernel.CalcPairExpPart(alpha, r - rOther[k], expectDer);
+                ASSERT_EQUAL_TOL(expectVal, val[k], 1e-15);
+                ASSERT_EQUAL_TOL(expectDer, der[k], 1e-15);
+            }
+            // Nothing is written past the row
+            ASSERT_EQUAL(-1.0, val[n]);
+            ASSERT_EQUAL(-1.0, der[n]);
+        }
+    }
+}
+
+// The table against CalcPairExpPart at random distances, on both sides of its range
+void testTable(ReferenceCalcFlexiBLEForceKernel &kernel, PairKernel::Isa Target, double alpha, double Tolerance)
+{
+    const double RMax = ReferenceCalcFlexiBLEForceKernel::UnderflowCutoff(alpha);
+    PairTable table;
+    table.Build(alpha, RMax, Tolerance);
+    ASSERT(table.Error <= Tolerance);
+    srand(2024);
+    const int n = 1000;
+    const double r = 1.5 * RMax;
+    vector<double> rOther(n), val(n, -1.0), der(n, -1.0);
+    for (int k = 0; k < n; k++)
+        rOther[k] = r - 1.2 * RMax * rand() / RAND_MAX;
+    rOther[0] = r;
+    rOther[1] = r + 0.1;
+    table.EvalRow(Target, r, rOther.data(), n - 1, val.data(), der.data());
+    // Nothing is written past the row
+    ASSERT_EQUAL(-1.0, val[n - 1]);
+    ASSERT_EQUAL(-1.0, der[n - 1]);
+    for (int k = 0; k < n - 1; k++)
+    {
+        double expectDer = 0.0;
+        const double expectVal = kernel.CalcPairExpPart(alpha, r - rOther[k], expectDer);
+        ASSERT_EQUAL_TOL(expectVal, val[k], Tolerance);
+        ASSERT_EQUAL_TOL(expectDer / alpha, der[k] / alpha, Tolerance);
+    }
+    ASSERT_EQUAL(0.0, val[0]);
+    ASSERT_EQUAL(0.0, val[1]);
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        Platform &platform = Platform::getPlatformByName("Reference");
+        ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+        const PairKernel::Isa targets[] = {PairKernel::Scalar, PairKernel::SSE2, PairKernel::AVX2, PairKernel::AVX512};
+        for (PairKernel::Isa target : targets)
+        {
+            if (!PairKernel::IsSupported(target))
+            {
+                cout << PairKernel::Name(target) << " not supported here, skipped" << endl;
+                continue;
+            }
+            testRows(kernel, target);
+            cout << PairKernel::Name(target) << " matches CalcPairExpPart" << endl;
+        }
+        ASSERT(PairKernel::IsSupported(PairKernel::Detect()));
+
+        const double alphas[] = {0.5, 10.0, 60.0};
+        for (double alpha : alphas)
+        {
+            for (PairKernel::Isa target : targets)
+            {
+                if (PairKernel::IsSupported(target))
+                {
+                    testTable(kernel, target, alpha, 1e-6);
+                    testTable(kernel, target, alpha, 1e-10);
+                }
+            }
+        }
+        // A small cap keeps the failing refinement cheap
+        try
+        {
+            PairTable table;
+            table.Build(10.0, 1.0, 1e-20, 1024);
+            throw OpenMMException("A tolerance below rounding was accepted");
+        }
+        catch (const OpenMMException &e)
+        {
+            ASSERT(string(e.what()).find("cannot reach") != string::npos);
+        }
+        cout << "Pair table matches CalcPairExpPart" << endl;
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include "ReferenceFlexiBLEKernels.h"
+#include "openmm/internal/AssertionUtilities.h"
+#include "AllocationCounter.h"
+#include "FlexiBLETestSystems.h"
+#include <iostream>
+#include <cmath>
+using namespace std;
+using namespace FlexiBLE;
+using namespace OpenMM;
+
+extern "C" OPENMM_EXPORT void registerFlexiBLEReferenceKernelFactories();
+
+const int NumSteps = 4;
+
+// Steps of a short trajectory, every atom moving a little from the last step
+vector<vector<Vec3>> trajectory(const vector<Vec3> &Start)
+{
+    vector<vector<Vec3>> Steps(NumSteps, Start);
+    for (int step = 0; step < NumSteps; step++)
+    {
+        for (int a = 0; a < (int)Start.size(); a++)
+            for (int k = 0; k < 3; k++)
+                Steps[step][a][k] += 0.002 * (step + 1) * sin(0.7 * a + 1.3 * k + 2.1 * step);
+    }
+    return Steps;
+}
+
+// Once the step buffers of the kernel have grown over a trajectory, running it again allocates nothing
+void testStepAllocations(int Shape, const vector<vector<double>> &Parameters, int CutoffMethod)
+{
+    Platform &platform = Platform::getPlatformByName("Reference");
+    System system;
+    vector<Vec3> positions;
+    FlexiBLEForce boundary;
+    buildSystem(system, positions, boundary, 2, Shape, Parameters);
+    boundary.SetCutoffMethod(CutoffMethod);
+    ReferenceCalcFlexiBLEForceKernel kernel(CalcFlexiBLEForceKernel::Name(), platform);
+    kernel.initialize(system, boundary);
+    const vector<vector<Vec3>> Steps = trajectory(positions);
+    vector<Vec3> Forces(positions.size());
+    vector<double> Energies;
+    for (const vector<Vec3> &Positions : Steps)
+        Energies.push_back(kernel.CalcForces(Positions, Forces));
+
+    const size_t before = AllocationCount;
+    for (int step = 0; step < NumSteps; step++)
+    {
+        for (Vec3 &f : Forces)
+            f = Vec3();
+        const double Energy = kernel.CalcForces(Steps[step], Forces);
+        ASSERT_EQUAL_TOL(Energies[step], Energy, 1e-12);
+    }
+    const size_t steady = AllocationCount - before;
+    cout << "Boundary shape " << Shape << ", CutoffMethod " << CutoffMethod << ": allocations over " << NumSteps << " steps after warm-up " << steady << endl;
+    ASSERT_EQUAL(0, (int)steady);
+}
+
+int main()
+{
+    try
+    {
+        registerFlexiBLEReferenceKernelFactories();
+        for (int CutoffMethod = 0; CutoffMethod < 2; CutoffMethod++)
+        {
+            testStepAllocations(0, {{0.4, 0.0, 0.0}, {0.4, 0.0, 0.0}}, CutoffMethod);
+            testStepAllocations(1, {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}}, CutoffMethod);
+        }
+    }
+    catch (const exception &e)
+    {
+        cout << "exception: " << e.what() << endl;
+        return 1;
+    }
+    cout << "Done" << endl;
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef FLEXIBLE_ALLOCATION_COUNTER_H_
+#define FLEXIBLE_ALLOCATION_COUNTER_H_
+
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include <cstdlib>
+#include <new>
+
+// Count every heap allocation made by the process. The global operators are replaced here, so only the file
+// holding main() of a test may include this header.
+static size_t AllocationCount = 0;
+
+void *operator new(size_t size)
+{
+    AllocationCount++;
+    void *p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+#endif /*FLEXIBLE_ALLOCATION_COUNTER_H_*/
@@ -0,0 +1,66 @@
+#ifndef FLEXIBLE_PAIR_TABLES_H_
+#define FLEXIBLE_PAIR_TABLES_H_
+
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "ReferenceFlexiBLEKernels.h"
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+namespace FlexiBLE
+{
+    /**
+     * Build the pair table of a layer with evenly spread molecules, as execute() does, and rank the molecules
+     * by distance. Shift moves the molecules a little, enough for some neighbours to trade places.
+     */
+    inline void buildPairTable(int N, double alpha, std::vector<std::vector<gInfo>> &g, std::vector<std::pair<int, double>> &rC_Atom, double Shift = 0.0)
+    {
+        g.assign(N, std::vector<gInfo>(N));
+        rC_Atom.resize(N);
+        for (int i = 0; i < N; i++)
+            rC_Atom[i] = std::make_pair(i, 0.02 * i + 0.001 * std::sin(i) + Shift * std::cos(3.0 * i));
+        for (int j = 0; j < N; j++)
+        {
+            for (int k = 0; k < N; k++)
+            {
+                double R = rC_Atom[j].second - rC_Atom[k].second;
+                if (R > 0)
+                {
+                    double aR = alpha * R;
+                    g[j][k].val = aR * aR * aR / (1 + aR);
+                    g[j][k].der = alpha * (2 * aR * aR * aR + 3 * aR * aR) / ((1 + aR) * (1 + aR));
+                }
+                else
+                {
+                    g[j][k].val = 0.0;
+                    g[j][k].der = 0.0;
+                }
+            }
+        }
+        std::stable_sort(rC_Atom.begin(), rC_Atom.end(), [](const std::pair<int, double> &lhs, const std::pair<int, double> &rhs)
+                         { return lhs.second < rhs.second; });
+    }
+
+    // Distances of N molecules spread evenly over a sphere at the density of water, 33 per nm^3, sorted
+    inline void buildSphereLayer(int N, std::vector<std::pair<int, double>> &rC_Atom)
+    {
+        std::srand(N);
+        const double Radius = std::cbrt(3.0 * N / (4.0 * M_PI * 33.0));
+        rC_Atom.resize(N);
+        for (int i = 0; i < N; i++)
+            rC_Atom[i] = std::make_pair(i, Radius * std::cbrt((std::rand() + 1.0) / (RAND_MAX + 1.0)));
+        std::stable_sort(rC_Atom.begin(), rC_Atom.end(), [](const std::pair<int, double> &lhs, const std::pair<int, double> &rhs)
+                         { return lhs.second < rhs.second; });
+    }
+} // namespace FlexiBLE
+
+#endif /*FLEXIBLE_PAIR_TABLES_H_*/
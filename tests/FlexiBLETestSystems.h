@@ -0,0 +1,75 @@
+#ifndef FLEXIBLE_TEST_SYSTEMS_H_
+#define FLEXIBLE_TEST_SYSTEMS_H_
+
+/* -------------------------------------------------------------------------- *
+ *                      FlexiBLE QM/MM Boundary Potential                     *
+ *                          ========================                          *
+ *                                                                            *
+ * An OpenMM plugin for FlexiBLE force calculation                            *
+ *                                                                            *
+ * Copyright (c) 2023 Kai Chen, William Glover's group                        *
+ * -------------------------------------------------------------------------- */
+
+#include "OpenMM.h"
+#include "FlexiBLEForce.h"
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <vector>
+
+namespace FlexiBLE
+{
+    // Size of every group of the test systems, and the QM molecules in it
+    const int TestMolecules = 60;
+    const int TestQMMolecules = 8;
+
+    /**
+     * Groups of triatomic molecules spread in a sphere, the QM ones of each group nearest to the origin, with
+     * the same random placement on every call. The boundary is set up as far as the thresholds and the boundary
+     * shape, the other settings are left for the test.
+     */
+    inline void buildSystem(OpenMM::System &system, std::vector<OpenMM::Vec3> &positions, FlexiBLEForce &boundary, int NumGroups, int Shape, const std::vector<std::vector<double>> &Parameters)
+    {
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<double> u(-1.0, 1.0);
+        std::vector<int> QMIndices, MoleculeInfo, AssignedIndex;
+        for (int g = 0; g < NumGroups; g++)
+        {
+            std::vector<std::pair<double, int>> r;
+            for (int m = 0; m < TestMolecules; m++)
+            {
+                OpenMM::Vec3 p;
+                do
+                {
+                    p = OpenMM::Vec3(u(rng), u(rng), u(rng)) * 1.2;
+                } while (p.dot(p) > 1.44);
+                for (int k = 0; k < 3; k++)
+                {
+                    system.addParticle(k == 0 ? 16.0 : 1.0);
+                    positions.push_back(p + OpenMM::Vec3(0.01 * k, -0.005 * k, 0.003 * k));
+                }
+                r.push_back(std::make_pair(std::sqrt(p.dot(p)), g * TestMolecules + m));
+            }
+            std::sort(r.begin(), r.end());
+            for (int m = 0; m < TestQMMolecules; m++)
+            {
+                for (int k = 0; k < 3; k++)
+                    QMIndices.push_back(3 * r[m].second + k);
+            }
+            MoleculeInfo.insert(MoleculeInfo.end(), {TestMolecules, 3});
+            AssignedIndex.push_back(-1);
+        }
+        std::sort(QMIndices.begin(), QMIndices.end());
+        boundary.SetQMIndices(QMIndices);
+        boundary.SetMoleculeInfo(MoleculeInfo);
+        boundary.SetAssignedIndex(AssignedIndex);
+        boundary.GroupingMolecules();
+        boundary.SetInitialThre(std::vector<double>(NumGroups, 0.01));
+        boundary.SetFlexiBLEMaxIt(std::vector<int>(NumGroups, 10));
+        boundary.SetScales(std::vector<double>(NumGroups, 0.5));
+        boundary.SetAlphas(std::vector<double>(NumGroups, 10.0));
+        boundary.SetBoundaryType(Shape, Parameters);
+    }
+} // namespace FlexiBLE
+
+#endif /*FLEXIBLE_TEST_SYSTEMS_H_*/